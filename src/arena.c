@@ -0,0 +1,276 @@
+#include <Rinternals.h>
+#include <Rversion.h>
+#include <R_ext/Rdynload.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/* Defined in fork.c */
+extern void bail_if(int err, const char * what);
+
+/* Defined in shm.c */
+extern int shm_create(const char * tmpdir);
+
+#if R_VERSION >= R_Version(3, 6, 0)
+#include <R_ext/Altrep.h>
+
+/* Shared input arena: vectors are copied once into a read-only shared mapping
+ * and exposed as ALTREP vectors that point into it. A shared mapping is not
+ * copied on write by fork(), and the data is outside of the R heap, so the
+ * garbage collector of a child never writes to these pages either. Hence all
+ * children read the same physical pages, and only the small vector headers
+ * count towards their memory.
+ *
+ * The ALTREP data1 is a list with the external pointer to the arena and the
+ * offset and length of the vector. The data2 is a private copy-on-write
+ * mapping of the same pages, which is only made if R asks for a writable
+ * pointer to the data. Pages that are not written remain shared. */
+
+#define ARENA_ALIGN 64
+
+typedef struct {
+  void * map;
+  size_t size;
+  int fd;
+} arena;
+
+static R_altrep_class_t arena_real;
+static R_altrep_class_t arena_integer;
+static R_altrep_class_t arena_raw;
+
+static void fin_arena(SEXP ptr){
+  arena * a = R_ExternalPtrAddr(ptr);
+  if(a == NULL)
+    return;
+  munmap(a->map, a->size);
+  if(a->fd >= 0)
+    close(a->fd);
+  free(a);
+  R_ClearExternalPtr(ptr);
+}
+
+static size_t elt_size(SEXPTYPE type){
+  switch(type){
+  case REALSXP: return sizeof(double);
+  case INTSXP: return sizeof(int);
+  case RAWSXP: return sizeof(Rbyte);
+  }
+  Rf_error("Only numeric, integer and raw vectors can be placed in a shared arena");
+  return 0;
+}
+
+static void * vector_ptr(SEXP x){
+  switch(TYPEOF(x)){
+  case REALSXP: return REAL(x);
+  case INTSXP: return INTEGER(x);
+  default: return RAW(x);
+  }
+}
+
+static R_xlen_t arena_length(SEXP x){
+  return (R_xlen_t) REAL(VECTOR_ELT(R_altrep_data1(x), 1))[1];
+}
+
+static size_t arena_offset(SEXP x){
+  return (size_t) REAL(VECTOR_ELT(R_altrep_data1(x), 1))[0];
+}
+
+/* Private mappings start at the page that holds the vector */
+static size_t page_offset(size_t offset){
+  size_t page = sysconf(_SC_PAGESIZE);
+  return offset / page * page;
+}
+
+static arena * arena_get(SEXP ptr){
+  arena * a = R_ExternalPtrAddr(ptr);
+  if(a == NULL)
+    Rf_error("This shared arena is no longer available");
+  return a;
+}
+
+/* Pointer to the data, which is the private mapping if there is one */
+static char * arena_data(SEXP x){
+  size_t offset = arena_offset(x);
+  SEXP priv = R_altrep_data2(x);
+  if(priv != R_NilValue)
+    return (char *) arena_get(priv)->map + offset - page_offset(offset);
+  return (char *) arena_get(VECTOR_ELT(R_altrep_data1(x), 0))->map + offset;
+}
+
+static R_xlen_t arena_Length(SEXP x){
+  return arena_length(x);
+}
+
+static Rboolean arena_Inspect(SEXP x, int pre, int deep, int pvec, void (*inspect_subtree)(SEXP, int, int, int)){
+  Rprintf(" shared arena (len=%lld, %s)\n", (long long) arena_length(x),
+          R_altrep_data2(x) == R_NilValue ? "read-only" : "copy-on-write");
+  return TRUE;
+}
+
+static SEXP arena_Duplicate(SEXP x, Rboolean deep){
+  R_xlen_t len = arena_length(x);
+  SEXP out = PROTECT(Rf_allocVector(TYPEOF(x), len));
+  memcpy(vector_ptr(out), arena_data(x), len * elt_size(TYPEOF(x)));
+  UNPROTECT(1);
+  return out;
+}
+
+/* The shared mapping is read-only, so writable access maps the same pages
+ * MAP_PRIVATE: the kernel only copies the pages that are actually written */
+static void * arena_Dataptr(SEXP x, Rboolean writeable){
+  if(writeable && R_altrep_data2(x) == R_NilValue){
+    arena * shared = arena_get(VECTOR_ELT(R_altrep_data1(x), 0));
+    size_t offset = arena_offset(x);
+    size_t start = page_offset(offset);
+    size_t size = offset - start + arena_length(x) * elt_size(TYPEOF(x));
+    void * map = mmap(NULL, size ? size : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE, shared->fd, start);
+    bail_if(map == MAP_FAILED, "map shared arena");
+    arena * a = malloc(sizeof(arena));
+    a->map = map;
+    a->size = size ? size : 1;
+    a->fd = -1;
+    SEXP ptr = PROTECT(R_MakeExternalPtr(a, R_NilValue, R_NilValue));
+    R_RegisterCFinalizerEx(ptr, fin_arena, TRUE);
+    R_set_altrep_data2(x, ptr);
+    UNPROTECT(1);
+  }
+  return arena_data(x);
+}
+
+static const void * arena_Dataptr_or_null(SEXP x){
+  return arena_data(x);
+}
+
+static R_xlen_t arena_region(SEXP x, R_xlen_t i, R_xlen_t n, void * buf){
+  R_xlen_t len = arena_length(x);
+  if(i >= len)
+    return 0;
+  if(n > len - i)
+    n = len - i;
+  size_t size = elt_size(TYPEOF(x));
+  memcpy(buf, arena_data(x) + i * size, n * size);
+  return n;
+}
+
+static double arena_real_Elt(SEXP x, R_xlen_t i){
+  return ((const double *) arena_data(x))[i];
+}
+
+static R_xlen_t arena_real_Get_region(SEXP x, R_xlen_t i, R_xlen_t n, double * buf){
+  return arena_region(x, i, n, buf);
+}
+
+static int arena_integer_Elt(SEXP x, R_xlen_t i){
+  return ((const int *) arena_data(x))[i];
+}
+
+static R_xlen_t arena_integer_Get_region(SEXP x, R_xlen_t i, R_xlen_t n, int * buf){
+  return arena_region(x, i, n, buf);
+}
+
+static Rbyte arena_raw_Elt(SEXP x, R_xlen_t i){
+  return ((const Rbyte *) arena_data(x))[i];
+}
+
+static R_xlen_t arena_raw_Get_region(SEXP x, R_xlen_t i, R_xlen_t n, Rbyte * buf){
+  return arena_region(x, i, n, buf);
+}
+
+static void arena_methods(R_altrep_class_t cls){
+  R_set_altrep_Length_method(cls, arena_Length);
+  R_set_altrep_Inspect_method(cls, arena_Inspect);
+  R_set_altrep_Duplicate_method(cls, arena_Duplicate);
+  R_set_altvec_Dataptr_method(cls, arena_Dataptr);
+  R_set_altvec_Dataptr_or_null_method(cls, arena_Dataptr_or_null);
+}
+
+void arena_init(DllInfo * dll){
+  arena_real = R_make_altreal_class("arena_real", "unix", dll);
+  arena_methods(arena_real);
+  R_set_altreal_Elt_method(arena_real, arena_real_Elt);
+  R_set_altreal_Get_region_method(arena_real, arena_real_Get_region);
+  arena_integer = R_make_altinteger_class("arena_integer", "unix", dll);
+  arena_methods(arena_integer);
+  R_set_altinteger_Elt_method(arena_integer, arena_integer_Elt);
+  R_set_altinteger_Get_region_method(arena_integer, arena_integer_Get_region);
+  arena_raw = R_make_altraw_class("arena_raw", "unix", dll);
+  arena_methods(arena_raw);
+  R_set_altraw_Elt_method(arena_raw, arena_raw_Elt);
+  R_set_altraw_Get_region_method(arena_raw, arena_raw_Get_region);
+}
+
+/* Copies all vectors into a single mapping, each aligned to a cache line */
+SEXP R_shared_arena(SEXP vectors, SEXP tmpdir){
+  int n = Rf_length(vectors);
+  size_t * offsets = (size_t *) R_alloc(n, sizeof(size_t));
+  size_t total = 0;
+  for(int i = 0; i < n; i++){
+    SEXP x = VECTOR_ELT(vectors, i);
+    offsets[i] = total;
+    total += (XLENGTH(x) * elt_size(TYPEOF(x)) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+  }
+  if(total == 0)
+    total = ARENA_ALIGN;
+  int fd = shm_create(CHAR(STRING_ELT(tmpdir, 0)));
+  bail_if(fd < 0, "create shared arena");
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  void * map = ftruncate(fd, total) == 0 ?
+    mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+  if(map == MAP_FAILED)
+    close(fd);
+  bail_if(map == MAP_FAILED, "map shared arena");
+  for(int i = 0; i < n; i++){
+    SEXP x = VECTOR_ELT(vectors, i);
+    memcpy((char *) map + offsets[i], vector_ptr(x), XLENGTH(x) * elt_size(TYPEOF(x)));
+  }
+  mprotect(map, total, PROT_READ);
+  arena * a = malloc(sizeof(arena));
+  a->map = map;
+  a->size = total;
+  a->fd = fd;
+  SEXP ptr = PROTECT(R_MakeExternalPtr(a, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(ptr, fin_arena, TRUE);
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, n));
+  for(int i = 0; i < n; i++){
+    SEXP x = VECTOR_ELT(vectors, i);
+    SEXP data1 = PROTECT(Rf_allocVector(VECSXP, 2));
+    SET_VECTOR_ELT(data1, 0, ptr);
+    SET_VECTOR_ELT(data1, 1, Rf_allocVector(REALSXP, 2));
+    REAL(VECTOR_ELT(data1, 1))[0] = offsets[i];
+    REAL(VECTOR_ELT(data1, 1))[1] = XLENGTH(x);
+    R_altrep_class_t cls = TYPEOF(x) == REALSXP ? arena_real : TYPEOF(x) == INTSXP ? arena_integer : arena_raw;
+    SEXP vec = R_new_altrep(cls, data1, R_NilValue);
+    SET_VECTOR_ELT(out, i, vec);
+    SHALLOW_DUPLICATE_ATTRIB(vec, x);
+    UNPROTECT(1);
+  }
+  UNPROTECT(2);
+  return out;
+}
+
+/* Returns TRUE for vectors in an arena, including those with a private
+ * mapping, whose pages remain shared until they are written */
+SEXP R_is_shared(SEXP x){
+  int shared = ALTREP(x) && (R_altrep_inherits(x, arena_real) || R_altrep_inherits(x, arena_integer) ||
+                             R_altrep_inherits(x, arena_raw));
+  return Rf_ScalarLogical(shared);
+}
+
+#else
+
+void arena_init(DllInfo * dll){
+
+}
+
+SEXP R_shared_arena(SEXP vectors, SEXP tmpdir){
+  Rf_error("shared_arena() requires R 3.6 or newer");
+  return R_NilValue;
+}
+
+SEXP R_is_shared(SEXP x){
+  return Rf_ScalarLogical(FALSE);
+}
+
+#endif
@@ -0,0 +1,219 @@
+#include <Rinternals.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/wait.h>
+
+#include "supervise.h"
+
+/* Status codes for the jobs, must match the R function. A job that is done
+ * has one of the CHILD_ codes. */
+#define JOB_RUNNING -1
+#define JOB_CANCELLED 4
+
+/* A child that runs in the background. The external pointer protects a list
+ * with the output callbacks, the yield callback, the escalation policy and,
+ * once the job is done, its value and usage. */
+typedef struct {
+  pid_t owner;
+  pid_t pid;
+  int status;
+  fork_child child;
+} fork_job;
+
+static void fin_job(SEXP ptr){
+  fork_job * job = R_ExternalPtrAddr(ptr);
+  if(job == NULL)
+    return;
+  //do not kill the job from within a fork that happens to run gc
+  if(job->status == JOB_RUNNING && job->owner == getpid())
+    child_kill(&job->child);
+  free(job);
+  R_ClearExternalPtr(ptr);
+}
+
+static fork_job * get_job(SEXP ptr){
+  if(TYPEOF(ptr) != EXTPTRSXP || !Rf_inherits(ptr, "fork_job"))
+    Rf_error("job is not a fork_job handle");
+  fork_job * job = R_ExternalPtrAddr(ptr);
+  if(job == NULL)
+    Rf_error("This fork_job handle is no longer valid");
+  return job;
+}
+
+/* Returns 0 if there were only messages from fork_yield(), unless the job
+ * must end regardless. */
+static int finish_job(SEXP ptr, fork_job * job, int force){
+  SEXP prot = R_ExternalPtrProtected(ptr);
+  SEXP out = child_finish(&job->child, force, VECTOR_ELT(prot, 0), VECTOR_ELT(prot, 1),
+                          VECTOR_ELT(prot, 4), &job->status);
+  if(out == NULL)
+    return 0;
+  if(job->status == CHILD_TIMEOUT && job->child.cancelled)
+    job->status = JOB_CANCELLED;
+  SET_VECTOR_ELT(prot, 2, VECTOR_ELT(out, 0));
+  SET_VECTOR_ELT(prot, 3, VECTOR_ELT(out, 1));
+  return 1;
+}
+
+SEXP R_eval_fork_async(SEXP call, SEXP env, SEXP subtmp, SEXP timeout, SEXP outfun, SEXP errfun,
+                       SEXP shm_threshold, SEXP compress, SEXP yieldfun, SEXP escalate){
+  double threshold = Rf_asReal(shm_threshold);
+  fork_job * job = calloc(1, sizeof(fork_job));
+  bail_if(job == NULL, "calloc() for fork_job");
+  SEXP prot = PROTECT(Rf_allocVector(VECSXP, 6));
+  SET_VECTOR_ELT(prot, 0, outfun);
+  SET_VECTOR_ELT(prot, 1, errfun);
+  SET_VECTOR_ELT(prot, 4, yieldfun);
+  SET_VECTOR_ELT(prot, 5, escalate);
+  SEXP ptr = PROTECT(R_MakeExternalPtr(job, R_NilValue, prot));
+  R_RegisterCFinalizerEx(ptr, fin_job, TRUE);
+  Rf_setAttrib(ptr, R_ClassSymbol, Rf_mkString("fork_job"));
+
+  //the handle is finalized like any other if the fork fails
+  job->owner = getpid();
+  job->status = CHILD_DIED;
+  fork_child * child = &job->child;
+  if(child_start(child, CHAR(STRING_ELT(subtmp, 0)), 0, outfun, errfun, escalate, threshold,
+                 Rf_asReal(timeout)) == 0){
+    child_eval(call, env, child->results, child->out, child->err, child->shm, threshold,
+               Rf_asInteger(compress));
+  }
+  job->pid = child->pid;
+  job->status = JOB_RUNNING;
+  UNPROTECT(2);
+  return ptr;
+}
+
+typedef struct {
+  SEXP jobs;
+  int nowait;
+  double until;
+  int timer;
+  struct pollfd * fds;
+} poll_state;
+
+/* The next moment at which a job times out, needs escalation, or we stop waiting */
+static double next_deadline(poll_state * state){
+  double next = state->until;
+  for(int i = 0; i < Rf_length(state->jobs); i++){
+    fork_job * job = R_ExternalPtrAddr(VECTOR_ELT(state->jobs, i));
+    double t = child_deadline(&job->child);
+    if(job->status == JOB_RUNNING && t > 0 && (next == 0 || t < next))
+      next = t;
+  }
+  return next;
+}
+
+static SEXP poll_loop(void * data){
+  poll_state * state = data;
+  int n = Rf_length(state->jobs);
+  short events = POLLIN | POLLERR | POLLHUP;
+  while(1){
+    int done = 0;
+    int nfds = 0;
+    for(int i = 0; i < n; i++){
+      fork_job * job = R_ExternalPtrAddr(VECTOR_ELT(state->jobs, i));
+      if(job->status != JOB_RUNNING){
+        done++;
+        continue;
+      }
+      child_pollfds(&job->child, state->fds + nfds);
+      nfds += FDS_PER_CHILD;
+    }
+    if(nfds == 0)
+      return R_NilValue;
+
+    //do not block if a job is done or we are past the waiting time
+    double deadline = next_deadline(state);
+    timer_set(state->timer, deadline);
+    struct pollfd timerfd = {state->timer, events, 0};
+    state->fds[nfds] = timerfd;
+    int expired = done || state->nowait || (state->until > 0 && mono_time() >= state->until);
+    int ms = expired ? 0 : timer_poll_ms(state->timer, deadline);
+    if(poll(state->fds, nfds + 1, ms) < 0 && errno != EINTR)
+      bail_if(1, "poll() on children");
+
+    //handle events, in the same order as the pollfd array
+    nfds = 0;
+    double time = mono_time();
+    for(int i = 0; i < n; i++){
+      SEXP ptr = VECTOR_ELT(state->jobs, i);
+      fork_job * job = R_ExternalPtrAddr(ptr);
+      if(job->status != JOB_RUNNING)
+        continue;
+      SEXP prot = R_ExternalPtrProtected(ptr);
+      struct pollfd * fds = state->fds + nfds;
+      nfds += FDS_PER_CHILD;
+      child_read_output(&job->child, fds, VECTOR_ELT(prot, 0), VECTOR_ELT(prot, 1));
+      int ready = child_ready(&job->child, fds);
+      if(ready && finish_job(ptr, job, ready == CHILD_GONE)){
+        done++;
+      } else if(child_timeout(&job->child, VECTOR_ELT(prot, 5), time)){
+        finish_job(ptr, job, 1);
+        done++;
+      }
+    }
+    if(expired || done || (state->until > 0 && time >= state->until))
+      return R_NilValue;
+    if(pending_interrupt())
+      Rf_error("interrupted while waiting for jobs; they continue in the background");
+  }
+}
+
+static void poll_cleanup(void * data){
+  poll_state * state = data;
+  if(state->timer >= 0)
+    close(state->timer);
+}
+
+/* Waits up to 'timeout' seconds for at least one of the jobs to finish. A
+ * timeout of 0 only handles pending events, Inf waits indefinitely. */
+SEXP R_fork_poll(SEXP jobs, SEXP timeout){
+  int n = Rf_length(jobs);
+  for(int i = 0; i < n; i++)
+    get_job(VECTOR_ELT(jobs, i));
+  double wait = Rf_asReal(timeout);
+  if(ISNAN(wait))
+    Rf_error("Timeout must be a number");
+  poll_state state = {
+    .jobs = jobs,
+    .nowait = wait <= 0,
+    .until = R_finite(wait) && wait > 0 ? mono_time() + wait : 0,
+    .timer = timer_create_fd(),
+    .fds = (struct pollfd *) R_alloc(FDS_PER_CHILD * n + 1, sizeof(struct pollfd))
+  };
+  R_ExecWithCleanup(poll_loop, &state, poll_cleanup, &state);
+  SEXP out = PROTECT(Rf_allocVector(LGLSXP, n));
+  for(int i = 0; i < n; i++)
+    LOGICAL(out)[i] = get_job(VECTOR_ELT(jobs, i))->status != JOB_RUNNING;
+  UNPROTECT(1);
+  return out;
+}
+
+SEXP R_fork_result(SEXP ptr){
+  fork_job * job = get_job(ptr);
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, 4));
+  SET_VECTOR_ELT(out, 0, VECTOR_ELT(R_ExternalPtrProtected(ptr), 2));
+  SET_VECTOR_ELT(out, 1, Rf_ScalarInteger(job->status));
+  SET_VECTOR_ELT(out, 2, Rf_ScalarInteger(job->pid));
+  SET_VECTOR_ELT(out, 3, VECTOR_ELT(R_ExternalPtrProtected(ptr), 3));
+  UNPROTECT(1);
+  return out;
+}
+
+SEXP R_fork_cancel(SEXP ptr){
+  fork_job * job = get_job(ptr);
+  if(job->status != JOB_RUNNING)
+    return Rf_ScalarLogical(FALSE);
+  //the job is stopped like one that times out, and fork_poll() takes the
+  //next steps; the R function waits for them
+  double time = mono_time();
+  child_cancel(&job->child, time);
+  if(child_timeout(&job->child, VECTOR_ELT(R_ExternalPtrProtected(ptr), 5), time))
+    finish_job(ptr, job, 1);
+  return Rf_ScalarLogical(TRUE);
+}
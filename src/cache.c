@@ -0,0 +1,116 @@
+#include <Rinternals.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+/* SHA-256 (FIPS 180-4), such that the key of a cached result can not be
+ * forged with an object that happens to hash to the same value */
+typedef struct {
+  uint32_t h[8];
+  unsigned char block[64];
+  size_t used;
+  uint64_t size;
+} hash_state;
+
+static const uint32_t K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t * h, const unsigned char * p){
+  uint32_t x[64];
+  for(int i = 0; i < 16; i++)
+    x[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 | (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+  for(int i = 16; i < 64; i++){
+    uint32_t s0 = ROTR(x[i - 15], 7) ^ ROTR(x[i - 15], 18) ^ (x[i - 15] >> 3);
+    uint32_t s1 = ROTR(x[i - 2], 17) ^ ROTR(x[i - 2], 19) ^ (x[i - 2] >> 10);
+    x[i] = x[i - 16] + s0 + x[i - 7] + s1;
+  }
+  uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+  for(int i = 0; i < 64; i++){
+    uint32_t t1 = k + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + x[i];
+    uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    k = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
+  h[5] += f;
+  h[6] += g;
+  h[7] += k;
+}
+
+static void sha256_update(hash_state * state, const unsigned char * buf, size_t len){
+  state->size += len;
+  while(len > 0){
+    size_t n = sizeof(state->block) - state->used;
+    if(n > len)
+      n = len;
+    memcpy(state->block + state->used, buf, n);
+    state->used += n;
+    buf += n;
+    len -= n;
+    if(state->used == sizeof(state->block)){
+      sha256_block(state->h, state->block);
+      state->used = 0;
+    }
+  }
+}
+
+static void sha256_final(hash_state * state, unsigned char * out){
+  uint64_t bits = state->size * 8;
+  unsigned char pad = 0x80;
+  sha256_update(state, &pad, 1);
+  pad = 0;
+  while(state->used != 56)
+    sha256_update(state, &pad, 1);
+  unsigned char len[8];
+  for(int i = 0; i < 8; i++)
+    len[i] = bits >> (56 - 8 * i);
+  sha256_update(state, len, 8);
+  for(int i = 0; i < 32; i++)
+    out[i] = state->h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+static void HashBytesCB(R_outpstream_t stream, void * raw, int size){
+  sha256_update(stream->data, raw, size);
+}
+
+static void HashCharCB(R_outpstream_t stream, int c){
+  unsigned char byte = c;
+  HashBytesCB(stream, &byte, 1);
+}
+
+/* Hashes the serialized object without materializing the serialized data */
+SEXP R_hash_object(SEXP object){
+  hash_state state = {
+    {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19},
+    {0}, 0, 0
+  };
+  struct R_outpstream_st stream;
+  R_InitOutPStream(&stream, &state, R_pstream_xdr_format, 3, HashCharCB, HashBytesCB, NULL, R_NilValue);
+  R_Serialize(object, &stream);
+  unsigned char digest[32];
+  sha256_final(&state, digest);
+  char key[65];
+  for(int i = 0; i < 32; i++)
+    snprintf(key + 2 * i, 3, "%02x", digest[i]);
+  return Rf_mkString(key);
+}
@@ -0,0 +1,258 @@
+#include <Rinternals.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+/* Defined in fork.c */
+extern void bail_if(int err, const char * what);
+
+#define CPU_PERIOD 100000
+
+#ifdef __linux__
+
+/* cgroup v2 controllers that we use. Order should match the limits in the R function. */
+static const char * cgroup_controllers[3] = {"memory", "cpu", "pids"};
+
+/* Returns 0 on success, or an errno value */
+static int cgroup_write(const char * dir, const char * file, const char * value){
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  FILE * fp = fopen(path, "w");
+  if(fp == NULL)
+    return errno;
+  int err = fputs(value, fp) < 0 ? errno : 0;
+  if(fclose(fp) != 0 && err == 0)
+    err = errno;
+  return err;
+}
+
+/* Reads a single number, or a 'key value' pair from a flat keyed file */
+static double cgroup_read(const char * dir, const char * file, const char * key){
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  FILE * fp = fopen(path, "r");
+  if(fp == NULL)
+    return NA_REAL;
+  double out = NA_REAL;
+  char name[256];
+  double value;
+  if(key == NULL){
+    if(fscanf(fp, "%lf", &value) == 1)
+      out = value;
+  } else {
+    while(fscanf(fp, "%255s %lf", name, &value) == 2){
+      if(strcmp(name, key) == 0){
+        out = value;
+        break;
+      }
+    }
+  }
+  fclose(fp);
+  return out;
+}
+
+static void cgroup_fail(int err, const char * what, const char * where){
+  if(err)
+    Rf_errorcall(R_NilValue, "Failed to %s in %s (%s)", what, where, strerror(err));
+}
+
+/* The cgroup of the current process, e.g. /sys/fs/cgroup/user.slice/... */
+static int cgroup_self(char * buf, size_t size){
+  FILE * fp = fopen("/proc/self/cgroup", "r");
+  if(fp == NULL)
+    return -1;
+  char line[4096];
+  int found = -1;
+  while(fgets(line, sizeof(line), fp)){
+    //the unified hierarchy has an entry '0::/path'
+    if(strncmp(line, "0::", 3) == 0){
+      line[strcspn(line, "\n")] = '\0';
+      snprintf(buf, size, "/sys/fs/cgroup%s", strcmp(line + 3, "/") ? line + 3 : "");
+      found = 0;
+      break;
+    }
+  }
+  fclose(fp);
+  return found;
+}
+
+SEXP R_cgroup_self(void){
+  char path[4096];
+  if(cgroup_self(path, sizeof(path)) < 0)
+    Rf_error("This process is not in a cgroup v2 hierarchy");
+  return Rf_mkString(path);
+}
+
+/* Controllers can only be enabled for a cgroup without processes of its own
+ * (the 'no internal processes' rule). Only if 'move' is set and the parent is
+ * the cgroup of this process, we move ourselves into a leaf. Controllers are
+ * enabled anyway for statistics, but only required for limits. */
+static void cgroup_enable(const char * parent, double * lim, int move){
+  char value[32];
+  for(int i = 0; i < 3; i++){
+    snprintf(value, sizeof(value), "+%s", cgroup_controllers[i]);
+    int err = cgroup_write(parent, "cgroup.subtree_control", value);
+    char self[4096];
+    int is_self = err == EBUSY && cgroup_self(self, sizeof(self)) == 0 && strcmp(self, parent) == 0;
+    if(is_self && move){
+      char leaf[4096];
+      snprintf(leaf, sizeof(leaf), "%s/main", parent);
+      if(mkdir(leaf, 0755) < 0 && errno != EEXIST)
+        cgroup_fail(errno, "create leaf cgroup", parent);
+      cgroup_fail(cgroup_write(leaf, "cgroup.procs", "0"), "move R process into leaf", leaf);
+      err = cgroup_write(parent, "cgroup.subtree_control", value);
+    }
+    if(is_self && !move && !ISNA(lim[i]))
+      Rf_errorcall(R_NilValue, "Cannot enable the %s controller in %s because this R process is in it, "
+        "and a cgroup with processes can not have limited children. Use cgroup_enable() to move R into "
+        "a leaf cgroup first, or use a different parent.", cgroup_controllers[i], parent);
+    if(!ISNA(lim[i]))
+      cgroup_fail(err, "enable cgroup controller", parent);
+  }
+}
+
+SEXP R_cgroup_enable(SEXP parent){
+  const char * dir = CHAR(STRING_ELT(parent, 0));
+  double lim[3] = {0, 0, 0};
+  cgroup_enable(dir, lim, 1);
+  return R_cgroup_self();
+}
+
+SEXP R_cgroup_create(SEXP parent, SEXP limits){
+  const char * dir = CHAR(STRING_ELT(parent, 0));
+  double * lim = REAL(limits);
+  cgroup_enable(dir, lim, 0);
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/forkXXXXXX", dir);
+  bail_if(mkdtemp(path) == NULL, "create cgroup");
+  char value[64];
+  int err = 0;
+  const char * what = NULL;
+  if(!ISNA(lim[0])){
+    if(R_finite(lim[0])){
+      snprintf(value, sizeof(value), "%.0f", lim[0]);
+    } else {
+      snprintf(value, sizeof(value), "max");
+    }
+    if((err = cgroup_write(path, "memory.max", value)))
+      what = "set memory.max";
+  }
+  if(!err && !ISNA(lim[1])){
+    if(R_finite(lim[1])){
+      snprintf(value, sizeof(value), "%.0f %d", lim[1] * CPU_PERIOD, CPU_PERIOD);
+    } else {
+      snprintf(value, sizeof(value), "max %d", CPU_PERIOD);
+    }
+    if((err = cgroup_write(path, "cpu.max", value)))
+      what = "set cpu.max";
+  }
+  if(!err && !ISNA(lim[2])){
+    if(R_finite(lim[2])){
+      snprintf(value, sizeof(value), "%.0f", lim[2]);
+    } else {
+      snprintf(value, sizeof(value), "max");
+    }
+    if((err = cgroup_write(path, "pids.max", value)))
+      what = "set pids.max";
+  }
+  //do not leave the new cgroup behind if it can not be limited
+  if(err){
+    rmdir(path);
+    cgroup_fail(err, what, path);
+  }
+  return Rf_mkString(path);
+}
+
+/* Moves the calling process (i.e. the child) into the cgroup */
+SEXP R_cgroup_enter(SEXP path){
+  const char * dir = CHAR(STRING_ELT(path, 0));
+  cgroup_fail(cgroup_write(dir, "cgroup.procs", "0"), "enter cgroup", dir);
+  return R_NilValue;
+}
+
+SEXP R_cgroup_stats(SEXP path){
+  const char * dir = CHAR(STRING_ELT(path, 0));
+  SEXP out = PROTECT(Rf_allocVector(REALSXP, 10));
+  double * x = REAL(out);
+  x[0] = cgroup_read(dir, "memory.peak", NULL);
+  x[1] = cgroup_read(dir, "memory.current", NULL);
+  x[2] = cgroup_read(dir, "memory.events", "oom_kill");
+  x[3] = cgroup_read(dir, "cpu.stat", "usage_usec") / 1e6;
+  x[4] = cgroup_read(dir, "cpu.stat", "user_usec") / 1e6;
+  x[5] = cgroup_read(dir, "cpu.stat", "system_usec") / 1e6;
+  x[6] = cgroup_read(dir, "cpu.stat", "nr_throttled");
+  x[7] = cgroup_read(dir, "cpu.stat", "throttled_usec") / 1e6;
+  x[8] = cgroup_read(dir, "pids.current", NULL);
+  x[9] = cgroup_read(dir, "pids.peak", NULL);
+  UNPROTECT(1);
+  return out;
+}
+
+/* Kills everything that is left in the cgroup and removes it. The kernel
+ * only allows for removing the cgroup once all processes have exited. */
+SEXP R_cgroup_remove(SEXP path){
+  const char * dir = CHAR(STRING_ELT(path, 0));
+  if(cgroup_write(dir, "cgroup.kill", "1") != 0){
+    char procs[4096];
+    snprintf(procs, sizeof(procs), "%s/cgroup.procs", dir);
+    FILE * fp = fopen(procs, "r");
+    int pid;
+    while(fp && fscanf(fp, "%d", &pid) == 1)
+      kill(pid, SIGKILL);
+    if(fp)
+      fclose(fp);
+  }
+  struct timespec pause = {0, 1000000};
+  for(int i = 0; i < 1000; i++){
+    if(rmdir(dir) == 0 || errno == ENOENT)
+      return Rf_ScalarLogical(TRUE);
+    if(errno != EBUSY)
+      break;
+    nanosleep(&pause, NULL);
+  }
+  Rf_warningcall(R_NilValue, "Failed to remove cgroup %s (%s)", dir, strerror(errno));
+  return Rf_ScalarLogical(FALSE);
+}
+
+#else
+
+static void cgroup_unsupported(void){
+  Rf_error("cgroups are only supported on Linux");
+}
+
+SEXP R_cgroup_self(void){
+  cgroup_unsupported();
+  return R_NilValue;
+}
+
+SEXP R_cgroup_enable(SEXP parent){
+  cgroup_unsupported();
+  return R_NilValue;
+}
+
+SEXP R_cgroup_create(SEXP parent, SEXP limits){
+  cgroup_unsupported();
+  return R_NilValue;
+}
+
+SEXP R_cgroup_enter(SEXP path){
+  cgroup_unsupported();
+  return R_NilValue;
+}
+
+SEXP R_cgroup_stats(SEXP path){
+  cgroup_unsupported();
+  return R_NilValue;
+}
+
+SEXP R_cgroup_remove(SEXP path){
+  cgroup_unsupported();
+  return R_NilValue;
+}
+
+#endif
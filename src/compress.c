@@ -0,0 +1,248 @@
+#include <Rinternals.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <zlib.h>
+
+/* Compressed transport: with compression enabled, the child deflates large
+ * results into the pipe, and the parent inflates them while unserializing,
+ * so the full compressed data never exists in memory. Whether and how the
+ * result is compressed is decided per result from a quick probe. */
+
+static const int R_DefaultSerializeVersion = 2;
+
+#define IN_BUFSIZE (1 << 20)
+#define CHUNK_SIZE (256 << 10)
+#define INTERRUPT_BYTES (16 << 20)
+
+/* Results smaller than this are not worth the setup of a deflate stream */
+#define COMPRESS_MIN_SIZE (64 << 10)
+
+/* The probe compresses a few samples of this size from across the payload */
+#define PROBE_SIZE (16 << 10)
+#define PROBE_COUNT 4
+
+/* Codecs, the values are sent to the parent as part of the status */
+#define CODEC_NONE 0
+#define CODEC_DEFLATE 1
+#define CODEC_HUFFMAN 2
+
+/* Defined in fork.c */
+extern void bail_if(int err, const char * what);
+extern void write_all(int fd, const char * buf, size_t len);
+
+/* Ratio of compressed to original size for samples of the data at level 1 */
+static double probe_ratio(const char * buf, size_t len){
+  unsigned char out[PROBE_SIZE + 1024];
+  double total_in = 0;
+  double total_out = 0;
+  for(int i = 0; i < PROBE_COUNT; i++){
+    size_t offset = (len - PROBE_SIZE) / (PROBE_COUNT - 1) * i;
+    uLongf size = sizeof(out);
+    if(compress2(out, &size, (const Bytef *) buf + offset, PROBE_SIZE, 1) != Z_OK)
+      return 1;
+    total_in += PROBE_SIZE;
+    total_out += size;
+  }
+  return total_out / total_in;
+}
+
+/* Picks a codec for a result in the child. The 'compress' setting is 0 to
+ * never compress, a negative value for automatic selection, or the deflate
+ * level to use for all results that are large enough. Data that compresses
+ * well gets fast deflate, data with only a skewed byte distribution (such as
+ * most doubles) gets huffman coding only, which is several times faster. */
+int compress_codec(const char * buf, size_t len, int compress, int * level){
+  if(compress == 0 || len < COMPRESS_MIN_SIZE)
+    return CODEC_NONE;
+  if(compress > 0){
+    *level = compress;
+    return CODEC_DEFLATE;
+  }
+  double ratio = probe_ratio(buf, len);
+  *level = 1;
+  if(ratio < 0.5)
+    return CODEC_DEFLATE;
+  if(ratio < 0.9)
+    return CODEC_HUFFMAN;
+  return CODEC_NONE;
+}
+
+/* Child side: a deflate stream with its output buffer */
+typedef struct {
+  z_stream zs;
+  unsigned char out[CHUNK_SIZE];
+} deflater;
+
+/* Sets up the stream before the child commits to the compressed transport,
+ * such that it can still send the result uncompressed if this fails */
+void * deflate_start(int codec, int level){
+  deflater * d = calloc(1, sizeof(deflater));
+  if(d == NULL)
+    return NULL;
+  int strategy = codec == CODEC_HUFFMAN ? Z_HUFFMAN_ONLY : Z_DEFAULT_STRATEGY;
+  if(deflateInit2(&d->zs, level, Z_DEFLATED, 15, 8, strategy) != Z_OK){
+    free(d);
+    return NULL;
+  }
+  return d;
+}
+
+/* Child side: deflates the data into the pipe in chunks */
+int deflate_to_pipe(int fd, void * state, const char * buf, size_t len){
+  deflater * d = state;
+  z_stream * zs = &d->zs;
+  unsigned char * out = d->out;
+  int ret = Z_OK;
+  while(ret != Z_STREAM_END){
+    //avail_in is 32 bits, so large payloads are passed in parts
+    if(zs->avail_in == 0 && len > 0){
+      size_t n = len > (1 << 30) ? (1 << 30) : len;
+      zs->next_in = (Bytef *) buf;
+      zs->avail_in = n;
+      buf += n;
+      len -= n;
+    }
+    zs->next_out = out;
+    zs->avail_out = CHUNK_SIZE;
+    ret = deflate(zs, len > 0 ? Z_NO_FLUSH : Z_FINISH);
+    if(ret == Z_STREAM_ERROR)
+      break;
+    write_all(fd, (const char *) out, CHUNK_SIZE - zs->avail_out);
+  }
+  deflateEnd(zs);
+  free(d);
+  return ret == Z_STREAM_END ? 0 : -1;
+}
+
+/* Child side: serialization into memory, used when there is no shared memory
+ * to probe the data in. The child never frees it. */
+typedef struct {
+  char * buf;
+  size_t len;
+  size_t cap;
+  int failed;
+} memory_stream;
+
+static void MemOutBytesCB(R_outpstream_t stream, void * raw, int size){
+  memory_stream * out = stream->data;
+  if(out->failed)
+    return;
+  if(out->len + size > out->cap){
+    size_t cap = out->cap ? out->cap : IN_BUFSIZE;
+    while(cap < out->len + size)
+      cap *= 2;
+    char * buf = realloc(out->buf, cap);
+    if(buf == NULL){
+      out->failed = 1;
+      return;
+    }
+    out->buf = buf;
+    out->cap = cap;
+  }
+  memcpy(out->buf + out->len, raw, size);
+  out->len += size;
+}
+
+static void MemOutCharCB(R_outpstream_t stream, int c){
+  MemOutBytesCB(stream, &c, sizeof(c));
+}
+
+void * memory_serialize(SEXP object, size_t * len){
+  memory_stream out = {NULL, 0, 0, 0};
+  struct R_outpstream_st stream;
+  R_InitOutPStream(&stream, &out, R_pstream_xdr_format, R_DefaultSerializeVersion, MemOutCharCB, MemOutBytesCB, NULL, R_NilValue);
+  R_Serialize(object, &stream);
+  if(out.failed){
+    free(out.buf);
+    return NULL;
+  }
+  *len = out.len;
+  return out.buf;
+}
+
+/* Parent side: inflates from the pipe on demand */
+typedef struct {
+  int fd;
+  z_stream zs;
+  unsigned char * in;
+  double bytes;
+  size_t unchecked;
+  size_t len;
+  int raw;
+} inflate_stream;
+
+static void inflate_into(inflate_stream * s, void * raw, size_t length){
+  s->zs.next_out = raw;
+  while(length > 0){
+    size_t n = length > (1 << 30) ? (1 << 30) : length;
+    s->zs.avail_out = n;
+    while(s->zs.avail_out > 0){
+      if(s->zs.avail_in == 0){
+        if(s->unchecked > INTERRUPT_BYTES){
+          R_CheckUserInterrupt();
+          s->unchecked = 0;
+        }
+        ssize_t len = read(s->fd, s->in, IN_BUFSIZE);
+        bail_if(len < 0, "read from pipe");
+        if(len == 0)
+          Rf_error("read from pipe: unexpected end of compressed stream");
+        s->zs.next_in = s->in;
+        s->zs.avail_in = len;
+        s->bytes += len;
+        s->unchecked += len;
+      }
+      int ret = inflate(&s->zs, Z_NO_FLUSH);
+      if(ret == Z_STREAM_END && s->zs.avail_out > 0)
+        Rf_error("inflate result: unexpected end of data");
+      if(ret != Z_OK && ret != Z_STREAM_END)
+        Rf_error("inflate result: %s", s->zs.msg ? s->zs.msg : "corrupt data");
+    }
+    length -= n;
+  }
+}
+
+static void InflateBytesCB(R_inpstream_t stream, void * raw, int length){
+  inflate_into(stream->data, raw, length);
+}
+
+static int InflateCharCB(R_inpstream_t stream){
+  int val;
+  InflateBytesCB(stream, &val, sizeof(val));
+  return val;
+}
+
+static SEXP inflate_fn(void * data){
+  inflate_stream * s = data;
+  if(s->raw){
+    SEXP out = PROTECT(Rf_allocVector(RAWSXP, s->len));
+    inflate_into(s, RAW(out), s->len);
+    UNPROTECT(1);
+    return out;
+  }
+  struct R_inpstream_st stream;
+  R_InitInPStream(&stream, s, R_pstream_xdr_format, InflateCharCB, InflateBytesCB, NULL, R_NilValue);
+  return R_Unserialize(&stream);
+}
+
+static void inflate_cleanup(void * data){
+  inflate_stream * s = data;
+  inflateEnd(&s->zs);
+}
+
+/* Reads a compressed result of 'len' bytes (after decompression) from the
+ * pipe, either a raw vector or a serialized object. Sets 'bytes' to the number
+ * of compressed bytes that were read. */
+SEXP inflate_from_pipe(int fd, size_t len, int raw, double * bytes){
+  inflate_stream s;
+  memset(&s, 0, sizeof(s));
+  s.fd = fd;
+  s.in = (unsigned char *) R_alloc(IN_BUFSIZE, 1);
+  s.len = len;
+  s.raw = raw;
+  if(inflateInit(&s.zs) != Z_OK)
+    Rf_error("Failed to initiate inflate stream");
+  SEXP out = R_ExecWithCleanup(inflate_fn, &s, inflate_cleanup, &s);
+  *bytes = s.bytes;
+  return out;
+}
@@ -0,0 +1,85 @@
+#include <Rinternals.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+
+/* Escalation policy for stopping a child on timeout or interrupt, as created
+ * by as_escalate() in R: a list with a signal for each step and the grace
+ * period in seconds before the next step. Signal 0 is the cancel message,
+ * which is written to a control pipe that the child can check with
+ * fork_cancelled(), such that it can wrap up and return partial results.
+ * Without a policy the child gets SIGINT, SIGTERM and SIGKILL, each followed
+ * by half a second of grace. */
+
+#define default_steps 3
+#define default_grace 0.5
+
+static const int default_signals[default_steps] = {SIGINT, SIGTERM, SIGKILL};
+
+int escalate_steps(SEXP policy){
+  return Rf_isNull(policy) ? default_steps : Rf_length(VECTOR_ELT(policy, 0));
+}
+
+static int step_signal(SEXP policy, int step){
+  return Rf_isNull(policy) ? default_signals[step] : INTEGER(VECTOR_ELT(policy, 0))[step];
+}
+
+static double step_grace(SEXP policy, int step){
+  return Rf_isNull(policy) ? default_grace : REAL(VECTOR_ELT(policy, 1))[step];
+}
+
+/* Takes the given step to stop the child and returns the time until which
+ * the parent waits before taking the next one. */
+double escalate_step(SEXP policy, int step, pid_t pid, int control, double now){
+  int sig = step_signal(policy, step);
+  if(sig){
+    kill(pid, sig);
+  } else if(control >= 0){
+    //a failed write means that earlier messages are still in the pipe
+    char msg = 1;
+    if(write(control, &msg, 1) < 0)
+      msg = 0;
+  }
+  return now + step_grace(policy, step);
+}
+
+/* The control pipe is only needed if the policy has a cancel step */
+int control_pipe(int fds[2], SEXP policy){
+  fds[0] = -1;
+  fds[1] = -1;
+  for(int i = 0; i < escalate_steps(policy); i++){
+    if(step_signal(policy, i) == 0)
+      return pipe(fds);
+  }
+  return 0;
+}
+
+/* Parent side: keeps the write end, which must never block */
+int control_parent(int fds[2]){
+  if(fds[0] >= 0)
+    close(fds[0]);
+  if(fds[1] >= 0)
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+  return fds[1];
+}
+
+/* Child side: the read end, or -1 if the parent will never send a cancel */
+static int control_fd = -1;
+static int cancelled = 0;
+
+void control_child(int fds[2]){
+  if(fds[1] >= 0)
+    close(fds[1]);
+  control_fd = fds[0];
+  cancelled = 0;
+}
+
+/* The pipe also becomes readable if the parent is gone */
+SEXP R_fork_cancelled(void){
+  if(!cancelled && control_fd >= 0){
+    struct pollfd ufds = {control_fd, POLLIN, 0};
+    cancelled = poll(&ufds, 1, 0) > 0;
+  }
+  return Rf_ScalarLogical(cancelled);
+}
@@ -0,0 +1,144 @@
+#include <Rinternals.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <string.h>
+#include <sys/time.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#endif
+
+#define waitms 200
+
+/* Event sources for supervising children. On Linux a pidfd becomes readable
+ * as soon as the child terminates and a timerfd fires at the deadline, so the
+ * parent does not need to rely on a fixed poll() tick to notice either. */
+
+double mono_time(void){
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  if(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int pidfd_open_child(pid_t pid){
+#if defined(__linux__) && defined(SYS_pidfd_open)
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  return -1;
+#endif
+}
+
+int timer_create_fd(void){
+#if defined(__linux__) && defined(TFD_NONBLOCK)
+  return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+#else
+  return -1;
+#endif
+}
+
+/* Arms the timer at the given monotonic time, or disarms it for 0 */
+void timer_set(int fd, double deadline){
+#if defined(__linux__) && defined(TFD_NONBLOCK)
+  if(fd < 0)
+    return;
+  struct itimerspec spec = {{0, 0}, {0, 0}};
+  if(deadline > 0){
+    spec.it_value.tv_sec = (time_t) deadline;
+    spec.it_value.tv_nsec = (long) ((deadline - floor(deadline)) * 1e9);
+    if(spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+      spec.it_value.tv_nsec = 1;
+  }
+  timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL);
+#endif
+}
+
+/* Timeout for poll(). With a timerfd we only need the tick for checking user
+ * interrupts, otherwise we also wake up in time for the deadline. */
+int timer_poll_ms(int fd, double deadline){
+  if(fd >= 0 || deadline <= 0)
+    return waitms;
+  double ms = ceil((deadline - mono_time()) * 1000);
+  return ms < 0 ? 0 : ms < waitms ? (int) ms : waitms;
+}
+
+/* Up to 8 escalation steps, plus the final SIGKILL if the child survived them */
+#define KILL_STAGES 9
+
+/* Latency statistics for all children supervised in this session */
+static struct {
+  double results;
+  double notify_sum;
+  double notify_max;
+  double timeouts;
+  double overshoot_sum;
+  double overshoot_max;
+  double kills;
+  double kill_sum;
+  double kill_max;
+  double stages[KILL_STAGES];
+} stats;
+
+/* Time between the child sending its result and the parent picking it up */
+void stats_notify(double child_time){
+  if(child_time <= 0)
+    return;
+  double latency = mono_time() - child_time;
+  stats.results++;
+  stats.notify_sum += latency;
+  if(latency > stats.notify_max)
+    stats.notify_max = latency;
+}
+
+/* Time between the deadline and the parent noticing it */
+void stats_timeout(double deadline){
+  double latency = mono_time() - deadline;
+  stats.timeouts++;
+  stats.overshoot_sum += latency;
+  if(latency > stats.overshoot_max)
+    stats.overshoot_max = latency;
+}
+
+/* Time between the first signal and the parent noticing that the child is gone,
+ * and the escalation step after which that happened */
+void stats_kill(double first_signal, int stage){
+  double latency = mono_time() - first_signal;
+  stats.kills++;
+  if(stage > 0 && stage <= KILL_STAGES)
+    stats.stages[stage - 1]++;
+  stats.kill_sum += latency;
+  if(latency > stats.kill_max)
+    stats.kill_max = latency;
+}
+
+SEXP R_fork_latency(SEXP reset){
+  int pidfd = pidfd_open_child(getpid());
+  int timer = timer_create_fd();
+  SEXP out = PROTECT(Rf_allocVector(REALSXP, 10 + KILL_STAGES));
+  double * x = REAL(out);
+  x[0] = stats.results;
+  x[1] = stats.results ? stats.notify_sum / stats.results : NA_REAL;
+  x[2] = stats.results ? stats.notify_max : NA_REAL;
+  x[3] = stats.timeouts;
+  x[4] = stats.timeouts ? stats.overshoot_sum / stats.timeouts : NA_REAL;
+  x[5] = stats.timeouts ? stats.overshoot_max : NA_REAL;
+  x[6] = stats.kills;
+  x[7] = stats.kills ? stats.kill_sum / stats.kills : NA_REAL;
+  x[8] = stats.kills ? stats.kill_max : NA_REAL;
+  x[9] = pidfd >= 0 && timer >= 0;
+  memcpy(x + 10, stats.stages, sizeof(stats.stages));
+  if(pidfd >= 0)
+    close(pidfd);
+  if(timer >= 0)
+    close(timer);
+  if(Rf_asLogical(reset))
+    memset(&stats, 0, sizeof(stats));
+  UNPROTECT(1);
+  return out;
+}
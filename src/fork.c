@@ -11,47 +11,62 @@
 #include <errno.h>
 #include <sys/time.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
 
 #ifdef __linux__
 #include <sys/prctl.h>
 #endif
 
+#include "supervise.h"
+
 static const int R_DefaultSerializeVersion = 2;
 
 #define r 0
 #define w 1
 
-#define waitms 200
+#define OUT_BUFSIZE (4 << 20)
+#define IN_BUFSIZE (1 << 20)
+#define INTERRUPT_BYTES (16 << 20)
 
 extern Rboolean R_isForkedChild;
 extern char * Sys_TempDir;
 
+/* Defined in events.c */
+extern void stats_notify(double child_time);
+
+/* Defined in output.c */
+extern int is_output_buffer(SEXP x);
+extern double buffer_read(SEXP ptr, int fd);
+extern void buffer_tick(SEXP ptr);
+extern void buffer_done(SEXP ptr);
+
+/* Defined in shm.c */
+extern void * shm_serialize(SEXP object, int fd, double threshold, size_t * len, int * shared);
+extern int raw_to_shm(SEXP object, int fd);
+extern SEXP unserialize_from_shm(int fd, size_t len);
+extern SEXP raw_from_shm(int fd, size_t len);
+
+/* Defined in compress.c */
+extern int compress_codec(const char * buf, size_t len, int compress, int * level);
+extern void * deflate_start(int codec, int level);
+extern int deflate_to_pipe(int fd, void * state, const char * buf, size_t len);
+extern void * memory_serialize(SEXP object, size_t * len);
+extern SEXP inflate_from_pipe(int fd, size_t len, int raw, double * bytes);
+
 void bail_if(int err, const char * what){
   if(err)
     Rf_errorcall(R_NilValue, "System failure for: %s (%s)", what, strerror(errno));
 }
 
-static void warn_if(int err, const char * what){
-  if(err)
-    Rf_warningcall(R_NilValue, "System failure for: %s (%s)", what, strerror(errno));
-}
-
 void kill_process_group(int signum) {
   kill(0, SIGKILL); // kills process group
   raise(SIGKILL); // just to be sure
 }
 
-static int wait_for_action2(int fd1, int fd2){
-  short events = POLLIN | POLLERR | POLLHUP;
-  struct pollfd ufds[2] = {
-    {fd1, events, events},
-    {fd2, events, events}
-  };
-  return poll(ufds, 2, waitms);
-}
-
 static void print_if(int err, const char * what){
   if(err){
     FILE *stream = fdopen(STDERR_FILENO, "w");
@@ -86,26 +101,68 @@ static void R_callback(SEXP fun, const char * buf, ssize_t len){
   UNPROTECT(2);
 }
 
-static void print_output(int pipe_out[2], SEXP fun){
+/* Returns the number of bytes that were read */
+double print_output(int fd, SEXP fun){
+  if(is_output_buffer(fun))
+    return buffer_read(fun, fd);
   static ssize_t len;
   static char buffer[65336];
-  while ((len = read(pipe_out[r], buffer, sizeof(buffer))) > 0)
+  double total = 0;
+  while ((len = read(fd, buffer, sizeof(buffer))) > 0){
     R_callback(fun, buffer, len);
+    total += len;
+  }
+  return total;
+}
+
+/* Delivers buffered output once its interval has passed */
+void print_output_tick(SEXP fun){
+  if(is_output_buffer(fun))
+    buffer_tick(fun);
+}
+
+/* Delivers output that is still buffered once a child is done */
+void print_output_done(SEXP fun){
+  if(is_output_buffer(fun))
+    buffer_done(fun);
 }
 
 static void check_interrupt_fn(void *dummy) {
   R_CheckUserInterrupt();
 }
 
-static int pending_interrupt(void) {
+int pending_interrupt(void) {
   return !(R_ToplevelExec(check_interrupt_fn, NULL));
 }
 
-static void pipe_set_read(int pipe[2]){
+/* Larger pipe buffer for results means fewer context switches (linux only) */
+void pipe_set_size(int fd){
+#ifdef F_SETPIPE_SZ
+  fcntl(fd, F_SETPIPE_SZ, IN_BUFSIZE);
+#endif
+}
+
+void pipe_set_read(int pipe[2]){
+  if(pipe[r] < 0)
+    return;
   close(pipe[w]);
   bail_if(fcntl(pipe[r], F_SETFL, O_NONBLOCK) < 0, "fcntl() in pipe_set_read");
 }
 
+/* Output to a file is written by the child directly, so it needs no pipe */
+int output_pipe(int fds[2], SEXP target){
+  if(is_output_file(target)){
+    fds[r] = fds[w] = -1;
+    return 0;
+  }
+  return pipe(fds);
+}
+
+/* The fd to which the child writes its output */
+int child_output(int fd, SEXP target){
+  return is_output_file(target) ? output_file_open(target) : fd;
+}
+
 static int wait_with_timeout(int fd, int ms){
   short events = POLLIN | POLLERR | POLLHUP;
   struct pollfd ufds = {fd, events, 0};
@@ -114,23 +171,110 @@ static int wait_with_timeout(int fd, int ms){
   return 0;
 }
 
-/* Callback functions to serialize/unserialize via the pipe */
-static void OutBytesCB(R_outpstream_t stream, void * raw, int size){
-  int * results = stream->data;
-  char * buf = raw;
-  ssize_t remaining = size;
-  while(remaining > 0){
-    ssize_t written = write(results[w], buf, remaining);
+/* Buffered streams to serialize/unserialize via the pipe. The serializer
+ * emits many tiny chunks, so we collect these into large blocks instead of
+ * doing a syscall (and interrupt check) for each of them. A chunked stream
+ * prefixes each block with its size, such that the reader never consumes
+ * more than the message, see R_fork_yield(). */
+typedef struct {
+  int fd;
+  char * buf;
+  size_t len;
+  size_t cap;
+  size_t unchecked;
+  size_t total;
+  int chunked;
+  size_t remaining;
+} pipe_stream;
+
+void write_all(int fd, const char * buf, size_t len){
+  while(len > 0){
+    ssize_t written = write(fd, buf, len);
     bail_if(written < 0, "write to pipe");
-    remaining -= written;
+    len -= written;
     buf += written;
   }
 }
 
-static void InBytesCB(R_inpstream_t stream, void *buf, int length){
-  R_CheckUserInterrupt();
-  int * results = stream->data;
-  bail_if(read(results[r], buf, length) < 0, "read from pipe");
+static void read_all(int fd, void * buf, size_t len){
+  char * ptr = buf;
+  while(len > 0){
+    ssize_t n = read(fd, ptr, len);
+    bail_if(n < 0, "read from pipe");
+    if(n == 0)
+      Rf_error("read from pipe: unexpected end of stream");
+    len -= n;
+    ptr += n;
+  }
+}
+
+static void write_block(pipe_stream * out, const char * buf, size_t len){
+  if(out->chunked){
+    if(len == 0)
+      return;
+    R_xlen_t size = len;
+    write_all(out->fd, (const char *) &size, sizeof(size));
+  }
+  write_all(out->fd, buf, len);
+}
+
+static void flush_stream(pipe_stream * stream){
+  write_block(stream, stream->buf, stream->len);
+  stream->len = 0;
+}
+
+static void OutBytesCB(R_outpstream_t stream, void * raw, int size){
+  pipe_stream * out = stream->data;
+  if(out->len + size > out->cap)
+    flush_stream(out);
+  if(size > out->cap){
+    write_block(out, raw, size);
+  } else {
+    memcpy(out->buf + out->len, raw, size);
+    out->len += size;
+  }
+}
+
+static void InBytesCB(R_inpstream_t stream, void *raw, int length){
+  pipe_stream * in = stream->data;
+  char * buf = raw;
+  while(length > 0){
+    if(in->len == in->cap){
+      if(in->unchecked > INTERRUPT_BYTES){
+        R_CheckUserInterrupt();
+        in->unchecked = 0;
+      }
+      size_t want = IN_BUFSIZE;
+      if(in->chunked){
+        while(in->remaining == 0){
+          R_xlen_t size = 0;
+          read_all(in->fd, &size, sizeof(size));
+          if(size == 0)
+            Rf_error("read from pipe: message ended early");
+          in->remaining = size;
+        }
+        if(want > in->remaining)
+          want = in->remaining;
+      }
+      ssize_t len = read(in->fd, in->buf, want);
+      bail_if(len < 0, "read from pipe");
+      if(len == 0)
+        Rf_error("read from pipe: unexpected end of stream");
+      if(in->chunked)
+        in->remaining -= len;
+      in->len = 0;
+      in->cap = len;
+      in->unchecked += len;
+      in->total += len;
+    }
+    size_t n = in->cap - in->len;
+    if(n > length)
+      n = length;
+    memcpy(buf, in->buf + in->len, n);
+    in->len += n;
+    length -= n;
+    buf += n;
+  }
 }
 
 /* Not sure if these are ever needed */
@@ -144,35 +288,54 @@ static int InCharCB(R_inpstream_t stream){
   return val;
 }
 
-static SEXP unserialize_from_pipe(int results[2]){
-  //unserialize stream
+static SEXP unserialize_stream(pipe_stream * in){
+  R_CheckUserInterrupt();
   struct R_inpstream_st stream;
-  R_InitInPStream(&stream, results, R_pstream_xdr_format, InCharCB, InBytesCB, NULL,  R_NilValue);
+  R_InitInPStream(&stream, in, R_pstream_xdr_format, InCharCB, InBytesCB, NULL,  R_NilValue);
   return R_Unserialize(&stream);
 }
 
-static void serialize_to_pipe(SEXP object, int results[2]){
-  //serialize output
+static SEXP unserialize_counted(int fd, double * bytes){
+  //unserialize stream
+  pipe_stream in = {fd, R_alloc(IN_BUFSIZE, 1), 0, 0, 0, 0, 0, 0};
+  SEXP out = unserialize_stream(&in);
+  if(bytes)
+    *bytes = in.total;
+  return out;
+}
+
+SEXP unserialize_from_pipe(int fd){
+  return unserialize_counted(fd, NULL);
+}
+
+static void serialize_stream(SEXP object, pipe_stream * out){
   PROTECT(object);
   struct R_outpstream_st stream;
-  R_InitOutPStream(&stream, results, R_pstream_xdr_format, R_DefaultSerializeVersion, OutCharCB, OutBytesCB, NULL, R_NilValue);
+  R_InitOutPStream(&stream, out, R_pstream_xdr_format, R_DefaultSerializeVersion, OutCharCB, OutBytesCB, NULL, R_NilValue);
   R_Serialize(object, &stream);
+  flush_stream(out);
   UNPROTECT(1);
 }
 
-static void raw_to_pipe(SEXP object, int results[2]){
-  R_xlen_t len = Rf_length(object);
-  bail_if(write(results[w], &len, sizeof(len)) < sizeof(len), "raw_to_pipe: send size-byte");
-  bail_if(write(results[w], RAW(object), len) < len, "raw_to_pipe: send raw data");
+void serialize_to_pipe(SEXP object, int fd){
+  //serialize output
+  pipe_stream out = {fd, R_alloc(OUT_BUFSIZE, 1), 0, OUT_BUFSIZE, 0, 0, 0, 0};
+  serialize_stream(object, &out);
+}
+
+static void raw_to_pipe(SEXP object, int fd){
+  R_xlen_t len = XLENGTH(object);
+  bail_if(write(fd, &len, sizeof(len)) < sizeof(len), "raw_to_pipe: send size-byte");
+  bail_if(write(fd, RAW(object), len) < len, "raw_to_pipe: send raw data");
 }
 
-SEXP raw_from_pipe(int results[2]){
+SEXP raw_from_pipe(int fd){
   R_xlen_t len = 0;
-  bail_if(read(results[r], &len, sizeof(len)) < sizeof(len), "raw_from_pipe: read size-byte");
+  bail_if(read(fd, &len, sizeof(len)) < sizeof(len), "raw_from_pipe: read size-byte");
   SEXP out = Rf_allocVector(RAWSXP, len);
   unsigned char * ptr = RAW(out);
   while(len > 0){
-    int bufsize = read(results[r], ptr, len);
+    int bufsize = read(fd, ptr, len);
     bail_if(bufsize <= 0, "failed to read from buffer");
     ptr += bufsize;
     len -= bufsize;
@@ -217,141 +380,344 @@ void prepare_fork(const char * tmpdir, int fd_out, int fd_err){
 #endif
 }
 
-SEXP R_eval_fork(SEXP call, SEXP env, SEXP subtmp, SEXP timeout, SEXP outfun, SEXP errfun){
-  int results[2];
-  int pipe_out[2];
-  int pipe_err[2];
-  bail_if(pipe(results), "create results pipe");
-  bail_if(pipe(pipe_out) || pipe(pipe_err), "create output pipes");
-
-  //fork the main process
-  int fail = -1;
-  pid_t pid = fork();
-  bail_if(pid < 0, "fork()");
-
-  if(pid == 0){
-    //prevents signals from being propagated to fork
-    setpgid(0, 0);
+/* a fresh tempdir for a child that shares a parent directory with others */
+void child_tmpdir(char * buf, size_t size, const char * parent){
+  snprintf(buf, size, "%s/jobXXXXXX", parent);
+  if(mkdtemp(buf) == NULL)
+    snprintf(buf, size, "%s", parent);
+}
 
-    //close read pipe
-    close(results[r]);
+/* common setup in a fresh child, before evaluating anything */
+void child_init(const char * tmpdir, int fd_out, int fd_err){
+  //prevents signals from being propagated to fork
+  setpgid(0, 0);
 
-    //This breaks parallel! See issue #11
-    safe_close(STDIN_FILENO);
+  //This breaks parallel! See issue #11
+  safe_close(STDIN_FILENO);
 
-    //Linux only: try to kill proccess group when parent dies
+  //Linux only: try to kill proccess group when parent dies
 #ifdef PR_SET_PDEATHSIG
-    if(getenv("KILL_ORPHAN_FORKS")){
-      prctl(PR_SET_PDEATHSIG, SIGTERM);
-      signal(SIGTERM, kill_process_group);      
-    }
+  if(getenv("KILL_ORPHAN_FORKS")){
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    signal(SIGTERM, kill_process_group);
+  }
 #endif
 
-    //this is the hacky stuff
-    prepare_fork(CHAR(STRING_ELT(subtmp, 0)), pipe_out[w], pipe_err[w]);
-
-    //execute
-    fail = 99; //not using this yet
-    SEXP object = R_tryEval(call, env, &fail);
-
-    //special case of raw vector
-    if(fail == 0 && object != NULL && TYPEOF(object) == RAWSXP)
-      fail = 1985;
-
-    //try to send the 'success byte' and then output
-    if(write(results[w], &fail, sizeof(fail)) > 0){
-      if(fail == 1985){
-        raw_to_pipe(object, results);
-      } else if(fail == 0 && object){
-        serialize_to_pipe(object, results);
-      } else {
-        const char * errbuf = NULL;
-#ifdef SYS_BUILD_SAFE
-        errbuf = R_curErrorBuf();
-#endif
-        serialize_to_pipe(mkString(errbuf ? errbuf : "unknown error in child"), results);
-      }
+  //this is the hacky stuff
+  prepare_fork(tmpdir, fd_out, fd_err);
+}
+
+/* The 'success byte' is sent together with the time at which the child
+ * finished, so the parent can measure how long it took to notice. */
+typedef struct {
+  double time;
+  int fail;
+} child_status;
+
+ssize_t send_status(int results, int fail){
+  child_status status = {mono_time(), fail};
+  return write(results, &status, sizeof(status));
+}
+
+/* Messages from fork_yield() are sent over the results pipe while the child
+ * runs, each with its own status. The value is serialized straight into the
+ * pipe as a chunked stream that ends with an empty chunk, so neither side
+ * holds a serialized copy of the message. The parent reads these messages
+ * whenever the pipe is ready, until the status of the final result. Once it
+ * has started on a message, the parent reads it in full before it gets back
+ * to output and timeouts. */
+static int yield_fd = -1;
+
+SEXP R_fork_yield(SEXP value){
+  if(yield_fd < 0)
+    Rf_error("fork_yield() can only be used in a child from eval_fork() or eval_fork_async()");
+  child_status status = {mono_time(), YIELD_STATUS};
+  write_all(yield_fd, (const char *) &status, sizeof(status));
+  pipe_stream out = {yield_fd, R_alloc(OUT_BUFSIZE, 1), 0, OUT_BUFSIZE, 0, 0, 1, 0};
+  serialize_stream(value, &out);
+  R_xlen_t end = 0;
+  write_all(yield_fd, (const char *) &end, sizeof(end));
+  return R_NilValue;
+}
+
+/* Skips the rest of a chunked message, up to and including the empty chunk */
+static void skip_chunks(pipe_stream * in){
+  while(1){
+    while(in->remaining > 0){
+      size_t want = in->remaining < IN_BUFSIZE ? in->remaining : IN_BUFSIZE;
+      ssize_t len = read(in->fd, in->buf, want);
+      bail_if(len < 0, "read from pipe");
+      if(len == 0)
+        Rf_error("read from pipe: unexpected end of stream");
+      in->remaining -= len;
     }
+    R_xlen_t size = 0;
+    read_all(in->fd, &size, sizeof(size));
+    if(size == 0)
+      return;
+    in->remaining = size;
+  }
+}
 
-    //suicide
-    close(results[w]);
-    close(pipe_out[w]);
-    close(pipe_err[w]);
-    raise(SIGKILL);
+/* Parent side: passes a message on to the callback, or drops it if there is none */
+static void read_yield(int results, SEXP fun){
+  const void * vmax = vmaxget();
+  pipe_stream in = {results, R_alloc(IN_BUFSIZE, 1), 0, 0, 0, 0, 1, 0};
+  if(isFunction(fun)){
+    int ok;
+    SEXP value = PROTECT(unserialize_stream(&in));
+    skip_chunks(&in);
+    SEXP call = PROTECT(LCONS(fun, LCONS(value, R_NilValue)));
+    R_tryEval(call, R_GlobalEnv, &ok);
+    UNPROTECT(2);
+  } else {
+    skip_chunks(&in);
   }
+  vmaxset(vmax);
+}
 
-  //start timer
-  struct timeval start, end;
-  gettimeofday(&start, NULL);
-
-  //start listening to child
-  close(results[w]);
-  pipe_set_read(pipe_out);
-  pipe_set_read(pipe_err);
-  int status = 0;
-  int killcount = 0;
-  double elapsed = 0;
-  int is_timeout = 0;
-  double totaltime = REAL(timeout)[0];
-  while(status == 0){ //mabye test for: is_alive(pid) ?
-    //wait for pipe to hear from child
-    if(is_timeout || pending_interrupt()){
-      //looks like rstudio always does SIGKILL, regardless
-      warn_if(kill(pid, killcount == 0 ? SIGINT : killcount == 1 ? SIGTERM : SIGKILL), "kill child");
-      status = wait_with_timeout(results[r], 500);
-      killcount++;
+/* evaluates the call in the child, sends back the result and dies.
+ * If shm is a valid fd, results of at least 'threshold' bytes are written
+ * into the shared memory file instead of the pipe. If 'compress' is not 0,
+ * large results that compress well are deflated into the pipe instead. */
+void child_eval(SEXP call, SEXP env, int results, int fd_out, int fd_err, int shm, double threshold,
+                int compress){
+  //execute
+  int fail = 99; //not using this yet
+  yield_fd = results;
+  SEXP object = R_tryEval(call, env, &fail);
+  size_t len = 0;
+  void * buf = NULL;
+  void * deflater = NULL;
+  int codec = 0;
+  int level = 0;
+
+  //special case of raw vector. If a deflate stream can not be set up, the
+  //result is sent uncompressed instead.
+  if(fail == 0 && object != NULL && TYPEOF(object) == RAWSXP){
+    len = XLENGTH(object);
+    codec = compress_codec((const char *) RAW(object), len, compress, &level);
+    deflater = codec ? deflate_start(codec, level) : NULL;
+    if(deflater){
+      buf = RAW(object);
+      fail = 1989;
     } else {
-      wait_for_action2(pipe_out[r], pipe_err[r]);
-      status = wait_with_timeout(results[r], 0);
-
-      //empty pipes
-      print_output(pipe_out, outfun);
-      print_output(pipe_err, errfun);
-      gettimeofday(&end, NULL);
-      elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
-      is_timeout = (totaltime > 0) && (elapsed > totaltime);
+      fail = (shm >= 0 && len > 0 && len >= threshold && raw_to_shm(object, shm) == 0) ? 1986 : 1985;
+    }
+  } else if(fail == 0 && object != NULL && (shm >= 0 || compress)){
+    int shared = 0;
+    buf = shm >= 0 ? shm_serialize(object, shm, threshold, &len, &shared) : NULL;
+    if(buf == NULL && compress)
+      buf = memory_serialize(object, &len);
+    codec = buf ? compress_codec(buf, len, compress, &level) : 0;
+    deflater = codec ? deflate_start(codec, level) : NULL;
+    if(deflater)
+      fail = 1988;
+    else if(shared)
+      fail = 1987;
+  }
+
+  //try to send the 'success byte' and then output
+  if(send_status(results, fail) > 0){
+    if(fail == 1985){
+      raw_to_pipe(object, results);
+    } else if(fail == 1986 || fail == 1987){
+      write_all(results, (const char *) &len, sizeof(len));
+    } else if(fail == 1988 || fail == 1989){
+      write_all(results, (const char *) &len, sizeof(len));
+      //a failure halfway ends the stream early, which the parent reports
+      deflate_to_pipe(results, deflater, buf, len);
+    } else if(fail == 0 && buf){
+      write_all(results, buf, len);
+    } else if(fail == 0 && object){
+      serialize_to_pipe(object, results);
+    } else {
+      const char * errbuf = NULL;
+#ifdef SYS_BUILD_SAFE
+      errbuf = R_curErrorBuf();
+#endif
+      serialize_to_pipe(mkString(errbuf ? errbuf : "unknown error in child"), results);
     }
   }
-  warn_if(close(pipe_out[r]), "close stdout");
-  warn_if(close(pipe_err[r]), "close stderr");
-  bail_if(status < 0, "poll() on failure pipe");
 
-  //read the 'success byte'
+  //suicide
+  close(results);
+  close(fd_out);
+  close(fd_err);
+  raise(SIGKILL);
+}
+
+/* Reads the 'success byte' and the result once the results pipe is ready.
+ * On success 'fail' is set to 0, otherwise the result is either NULL or the
+ * error message from the child. If 'bytes' is not NULL, it is set to the size
+ * of the result that was transferred, and 'decoded' to its size after
+ * decompression. Messages from fork_yield() that come first are passed to
+ * 'yieldfun'; if the final result is not there yet, 'fail' is YIELD_PENDING. */
+SEXP read_child_result(int results, int shm, int * fail, double * bytes, double * decoded, SEXP yieldfun){
   SEXP res = R_NilValue;
-  if(status > 0){
-    int child_is_alive = read(results[r], &fail, sizeof(fail));
+  double size = 0;
+  double full = -1;
+  child_status status = {0, -1};
+  int child_is_alive = read(results, &status, sizeof(status));
+  bail_if(child_is_alive < 0, "read pipe");
+  while(child_is_alive > 0 && status.fail == YIELD_STATUS){
+    read_yield(results, yieldfun);
+    if(!wait_with_timeout(results, 0)){
+      child_is_alive = 0;
+      status.fail = YIELD_PENDING;
+      break;
+    }
+    child_is_alive = read(results, &status, sizeof(status));
     bail_if(child_is_alive < 0, "read pipe");
-    if(child_is_alive > 0){
-      if(fail == 0){
-        res = unserialize_from_pipe(results);
-      } else if(fail == 1985){
-        res = raw_from_pipe(results);
-        fail = 0;
-      }
+  }
+  *fail = status.fail;
+  if(child_is_alive > 0){
+    stats_notify(status.time);
+    if(*fail == 0 || *fail == 1){
+      res = unserialize_counted(results, &size);
+    } else if(*fail == 1985){
+      res = raw_from_pipe(results);
+      size = XLENGTH(res);
+      *fail = 0;
+    } else if(*fail == 1986 || *fail == 1987){
+      size_t len = 0;
+      bail_if(read(results, &len, sizeof(len)) < sizeof(len), "read shared result size");
+      res = *fail == 1986 ? raw_from_shm(shm, len) : unserialize_from_shm(shm, len);
+      size = len;
+      *fail = 0;
+    } else if(*fail == 1988 || *fail == 1989){
+      size_t len = 0;
+      bail_if(read(results, &len, sizeof(len)) < sizeof(len), "read compressed result size");
+      res = inflate_from_pipe(results, len, *fail == 1989, &size);
+      full = len;
+      *fail = 0;
     }
+  } else if(*fail != YIELD_PENDING){
+    *fail = -1;
   }
+  if(bytes)
+    *bytes = size;
+  if(decoded)
+    *decoded = full < 0 ? size : full;
+  return res;
+}
 
-  //cleanup
-  close(results[r]);
-  kill(-pid, SIGKILL); //kills entire process group
-  waitpid(pid, NULL, 0); //wait for zombie(s) to die
+/* Usage of the most recent child from eval_fork() or pool_eval() */
+static SEXP last_usage = NULL;
 
-  //actual R error
-  if(status == 0 || fail){
-    if(killcount && is_timeout){
-      Rf_errorcall(call, "timeout reached (%f sec)", totaltime);
-    } else if(killcount) {
-      Rf_errorcall(call, "process interrupted by parent");
-    } else if(isString(res) && Rf_length(res) && Rf_length(STRING_ELT(res, 0)) > 8){
-      Rf_errorcall(R_NilValue, "%s", CHAR(STRING_ELT(res, 0)));
+void set_last_usage(SEXP usage){
+  if(last_usage)
+    R_ReleaseObject(last_usage);
+  R_PreserveObject(usage);
+  last_usage = usage;
+}
+
+SEXP R_fork_usage(void){
+  return last_usage ? last_usage : R_NilValue;
+}
+
+typedef struct {
+  fork_child * child;
+  SEXP outfun;
+  SEXP errfun;
+  SEXP yieldfun;
+  SEXP policy;
+  int timer;
+  int status;
+} wait_state;
+
+static SEXP wait_loop(void * data){
+  wait_state * state = data;
+  fork_child * child = state->child;
+  short events = POLLIN | POLLERR | POLLHUP;
+  struct pollfd fds[FDS_PER_CHILD + 1];
+  while(1){
+    //wait for pipe to hear from child, for the child to exit, or for the next deadline
+    child_pollfds(child, fds);
+    double deadline = child_deadline(child);
+    timer_set(state->timer, deadline);
+    struct pollfd timerfd = {state->timer, events, 0};
+    fds[FDS_PER_CHILD] = timerfd;
+    if(poll(fds, FDS_PER_CHILD + 1, timer_poll_ms(state->timer, deadline)) < 0 && errno != EINTR)
+      bail_if(1, "poll() on child");
+    child_read_output(child, fds, state->outfun, state->errfun);
+
+    //messages from fork_yield() do not end the supervision
+    int ready = child_ready(child, fds);
+    if(ready){
+      SEXP out = child_finish(child, ready == CHILD_GONE, state->outfun, state->errfun, state->yieldfun,
+                              &state->status);
+      if(out != NULL)
+        return out;
     }
-    Rf_errorcall(call, "child process has died");
+    if(fds[FDS_PER_CHILD].revents){
+      uint64_t expirations;
+      if(read(state->timer, &expirations, sizeof(expirations)) < 0)
+        expirations = 0;
+    }
+    double now = mono_time();
+    if(child->killcount == 0 && !child->cancelled && pending_interrupt())
+      child_cancel(child, now);
+    if(child_timeout(child, state->policy, now))
+      return child_finish(child, 1, state->outfun, state->errfun, state->yieldfun, &state->status);
   }
+}
+
+static void wait_cleanup(void * data){
+  wait_state * state = data;
+  if(state->timer >= 0)
+    close(state->timer);
+  if(state->child->pid > 0)
+    child_kill(state->child);
+}
+
+/* Supervises a child from child_start() or child_adopt() until it is done:
+ * streams input and output, enforces the timeout, reads back the result and
+ * cleans up. On timeout or interrupt the child is stopped following the
+ * escalation policy. Returns the value of the child, or raises its error. A
+ * child without a result pipe just runs until it exits, and then its usage
+ * is returned. */
+SEXP wait_for_child(SEXP call, fork_child * child, double timeout, SEXP outfun, SEXP errfun,
+                    SEXP yieldfun, SEXP policy){
+  int has_result = child->results >= 0;
+  wait_state state = {
+    .child = child,
+    .outfun = outfun,
+    .errfun = errfun,
+    .yieldfun = yieldfun,
+    .policy = policy,
+    .timer = timer_create_fd(),
+    .status = CHILD_DIED
+  };
+  SEXP out = PROTECT(R_ExecWithCleanup(wait_loop, &state, wait_cleanup, &state));
+  SEXP res = has_result ? VECTOR_ELT(out, 0) : VECTOR_ELT(out, 1);
+  set_last_usage(VECTOR_ELT(out, 1));
+  UNPROTECT(1);
 
-  //add timeout attribute
+  //actual R error
+  if(state.status == CHILD_TIMEOUT && child->cancelled){
+    Rf_errorcall(call, "process interrupted by parent");
+  } else if(state.status == CHILD_TIMEOUT){
+    Rf_errorcall(call, "timeout reached (%f sec)", timeout);
+  } else if(state.status == CHILD_ERROR && Rf_length(STRING_ELT(res, 0)) > 8){
+    Rf_errorcall(R_NilValue, "%s", CHAR(STRING_ELT(res, 0)));
+  } else if(state.status != CHILD_OK && has_result){
+    Rf_errorcall(call, "child process has died");
+  }
   return res;
 }
 
+SEXP R_eval_fork(SEXP call, SEXP env, SEXP subtmp, SEXP timeout, SEXP outfun, SEXP errfun, SEXP shm_threshold,
+                 SEXP compress, SEXP yieldfun, SEXP escalate){
+  fork_child child;
+  double threshold = Rf_asReal(shm_threshold);
+  if(child_start(&child, CHAR(STRING_ELT(subtmp, 0)), 0, outfun, errfun, escalate, threshold,
+                 REAL(timeout)[0]) == 0){
+    child_eval(call, env, child.results, child.out, child.err, child.shm, threshold, Rf_asInteger(compress));
+  }
+  return wait_for_child(call, &child, REAL(timeout)[0], outfun, errfun, yieldfun, escalate);
+}
+
 SEXP R_freeze(SEXP interrupt) {
   int loop = 1;
   while(loop){
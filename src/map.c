@@ -0,0 +1,172 @@
+#include <Rinternals.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/wait.h>
+
+#include "supervise.h"
+
+/* One running child and the index of its task. A slot with pid 0 is free. */
+typedef struct {
+  fork_child child;
+  int task;
+} map_slot;
+
+typedef struct {
+  SEXP calls;
+  SEXP env;
+  const char * tmpdir;
+  double timeout;
+  double threshold;
+  int compress;
+  SEXP outfun;
+  SEXP errfun;
+  SEXP yieldfun;
+  SEXP policy;
+  SEXP values;
+  int * status;
+  int cores;
+  int timer;
+  map_slot * slots;
+  struct pollfd * fds;
+} map_state;
+
+static void start_task(map_state * state, map_slot * slot, int task){
+  fork_child * child = &slot->child;
+  slot->task = task;
+  if(child_start(child, state->tmpdir, 1, state->outfun, state->errfun, state->policy,
+                 state->threshold, state->timeout) == 0){
+    child_eval(VECTOR_ELT(state->calls, task), state->env, child->results, child->out, child->err,
+               child->shm, state->threshold, state->compress);
+  }
+}
+
+/* Returns 0 if there were only messages from fork_yield(), unless the task
+ * must end regardless */
+static int finish_task(map_state * state, map_slot * slot, int force){
+  SEXP out = child_finish(&slot->child, force, state->outfun, state->errfun, state->yieldfun,
+                          &state->status[slot->task]);
+  if(out == NULL)
+    return 0;
+  SET_VECTOR_ELT(state->values, slot->task, VECTOR_ELT(out, 0));
+  return 1;
+}
+
+/* The next moment at which a task times out or needs escalation */
+static double next_deadline(map_state * state){
+  double next = 0;
+  for(int i = 0; i < state->cores; i++){
+    map_slot * slot = &state->slots[i];
+    double t = child_deadline(&slot->child);
+    if(slot->child.pid > 0 && t > 0 && (next == 0 || t < next))
+      next = t;
+  }
+  return next;
+}
+
+static SEXP map_loop(void * data){
+  map_state * state = data;
+  int ntasks = Rf_length(state->calls);
+  int next = 0;
+  int running = 0;
+  while(next < ntasks || running > 0){
+    if(pending_interrupt())
+      Rf_error("process interrupted by parent");
+
+    //fill up the free slots
+    for(int i = 0; i < state->cores && next < ntasks; i++){
+      if(state->slots[i].child.pid == 0){
+        start_task(state, &state->slots[i], next++);
+        running++;
+      }
+    }
+
+    //wait for any of the running children, or the next deadline
+    int nfds = 0;
+    short events = POLLIN | POLLERR | POLLHUP;
+    for(int i = 0; i < state->cores; i++){
+      map_slot * slot = &state->slots[i];
+      if(slot->child.pid > 0){
+        child_pollfds(&slot->child, state->fds + nfds);
+        nfds += FDS_PER_CHILD;
+      }
+    }
+    double deadline = next_deadline(state);
+    timer_set(state->timer, deadline);
+    struct pollfd timerfd = {state->timer, events, 0};
+    state->fds[nfds] = timerfd;
+    if(poll(state->fds, nfds + 1, timer_poll_ms(state->timer, deadline)) < 0 && errno != EINTR)
+      bail_if(1, "poll() on children");
+
+    //handle events, in the same order as the pollfd array
+    nfds = 0;
+    double time = mono_time();
+    for(int i = 0; i < state->cores; i++){
+      map_slot * slot = &state->slots[i];
+      if(slot->child.pid == 0)
+        continue;
+      struct pollfd * fds = state->fds + nfds;
+      nfds += FDS_PER_CHILD;
+      child_read_output(&slot->child, fds, state->outfun, state->errfun);
+      int ready = child_ready(&slot->child, fds);
+      if(ready && finish_task(state, slot, ready == CHILD_GONE)){
+        running--;
+      } else if(child_timeout(&slot->child, state->policy, time)){
+        finish_task(state, slot, 1);
+        running--;
+      }
+    }
+  }
+  return R_NilValue;
+}
+
+static void map_cleanup(void * data){
+  map_state * state = data;
+  if(state->timer >= 0)
+    close(state->timer);
+  for(int i = 0; i < state->cores; i++){
+    if(state->slots[i].child.pid > 0)
+      child_kill(&state->slots[i].child);
+  }
+}
+
+SEXP R_eval_fork_map(SEXP calls, SEXP env, SEXP subtmp, SEXP cores, SEXP timeout,
+                     SEXP outfun, SEXP errfun, SEXP shm_threshold, SEXP compress, SEXP yieldfun,
+                     SEXP escalate){
+  int n = Rf_length(calls);
+  int ncores = Rf_asInteger(cores);
+  if(ncores < 1 || ncores == NA_INTEGER)
+    Rf_error("Number of cores must be at least 1");
+  if(ncores > n)
+    ncores = n > 0 ? n : 1;
+  SEXP values = PROTECT(Rf_allocVector(VECSXP, n));
+  SEXP status = PROTECT(Rf_allocVector(INTSXP, n));
+  map_state state = {
+    .calls = calls,
+    .env = env,
+    .tmpdir = CHAR(STRING_ELT(subtmp, 0)),
+    .timeout = Rf_asReal(timeout),
+    .threshold = Rf_asReal(shm_threshold),
+    .compress = Rf_asInteger(compress),
+    .outfun = outfun,
+    .errfun = errfun,
+    .yieldfun = yieldfun,
+    .policy = escalate,
+    .values = values,
+    .status = INTEGER(status),
+    .cores = ncores,
+    .timer = timer_create_fd(),
+    .slots = (map_slot *) R_alloc(ncores, sizeof(map_slot)),
+    .fds = (struct pollfd *) R_alloc(FDS_PER_CHILD * ncores + 1, sizeof(struct pollfd))
+  };
+  memset(state.slots, 0, ncores * sizeof(map_slot));
+  R_ExecWithCleanup(map_loop, &state, map_cleanup, &state);
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(out, 0, values);
+  SET_VECTOR_ELT(out, 1, status);
+  UNPROTECT(3);
+  return out;
+}
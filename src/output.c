@@ -0,0 +1,293 @@
+#include <Rinternals.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/* Defined in events.c */
+extern double mono_time(void);
+
+/* Defined in prepare.c */
+extern void * scratch_alloc(size_t size);
+extern void scratch_free(void * buf, size_t size);
+
+/* Native buffer for the output of children. Output is appended to a ring
+ * that grows up to at most 'cap' bytes. If there is a callback, it receives the contents in
+ * large chunks: when the buffer is full, when 'interval' has passed since the
+ * previous chunk, or when the child is done. Without a callback, the buffer
+ * keeps the last 'cap' bytes of output, which can be read with output_value(). */
+typedef struct {
+  char * buf;
+  size_t size;
+  size_t cap;
+  size_t start;
+  size_t len;
+  double interval;
+  double last;
+  int lines;
+  pid_t owner;
+} output_buffer;
+
+/* The ring is scratch memory that is not mapped in forked children. A child
+ * that uses the buffer, e.g. for a nested eval_fork(), gets a fresh empty ring. */
+static output_buffer * own_buffer(output_buffer * out){
+  if(out == NULL || out->owner == getpid())
+    return out;
+  out->size = out->cap < 65536 ? out->cap : 65536;
+  out->buf = scratch_alloc(out->size);
+  if(out->buf == NULL)
+    Rf_error("Failed to allocate output buffer of %.0f bytes", (double) out->size);
+  out->start = 0;
+  out->len = 0;
+  out->owner = getpid();
+  return out;
+}
+
+static output_buffer * get_buffer(SEXP ptr){
+  if(TYPEOF(ptr) != EXTPTRSXP || !Rf_inherits(ptr, "output_buffer"))
+    Rf_error("object is not an output_buffer");
+  output_buffer * out = R_ExternalPtrAddr(ptr);
+  if(out == NULL)
+    Rf_error("This output_buffer is no longer valid");
+  return own_buffer(out);
+}
+
+static void fin_buffer(SEXP ptr){
+  output_buffer * out = R_ExternalPtrAddr(ptr);
+  if(out){
+    if(out->owner == getpid())
+      scratch_free(out->buf, out->size);
+    free(out);
+  }
+  R_ClearExternalPtr(ptr);
+}
+
+int is_output_buffer(SEXP x){
+  return TYPEOF(x) == EXTPTRSXP && Rf_inherits(x, "output_buffer");
+}
+
+/* Copies 'n' bytes from the start of the ring into 'dest' */
+static void ring_copy(output_buffer * out, char * dest, size_t n){
+  size_t first = out->size - out->start;
+  if(first > n)
+    first = n;
+  memcpy(dest, out->buf + out->start, first);
+  memcpy(dest + first, out->buf, n - first);
+}
+
+static void ring_consume(output_buffer * out, size_t n){
+  out->start = (out->start + n) % out->size;
+  out->len -= n;
+}
+
+/* Doubles the ring (up to the cap) until it fits 'need' bytes */
+static void ring_grow(output_buffer * out, size_t need){
+  size_t size = out->size;
+  while(size < need && size < out->cap)
+    size = size * 2 < out->cap ? size * 2 : out->cap;
+  if(size == out->size)
+    return;
+  char * buf = scratch_alloc(size);
+  if(buf == NULL)
+    return;
+  ring_copy(out, buf, out->len);
+  scratch_free(out->buf, out->size);
+  out->buf = buf;
+  out->size = size;
+  out->start = 0;
+}
+
+/* Appends data, dropping the oldest bytes if the ring is full */
+static void ring_append(output_buffer * out, const char * data, size_t n){
+  if(out->len + n > out->size)
+    ring_grow(out, out->len + n);
+  if(n >= out->size){
+    data += n - out->size;
+    n = out->size;
+    out->start = 0;
+    out->len = 0;
+  } else if(out->len + n > out->size){
+    ring_consume(out, out->len + n - out->size);
+  }
+  size_t end = (out->start + out->len) % out->size;
+  size_t first = out->size - end;
+  if(first > n)
+    first = n;
+  memcpy(out->buf + end, data, first);
+  memcpy(out->buf, data + first, n - first);
+  out->len += n;
+}
+
+/* Splits complete lines from the buffer into a character vector. Unless
+ * 'final', an incomplete last line stays in the buffer. */
+static SEXP take_lines(output_buffer * out, int final){
+  char * tmp = R_alloc(out->len + 1, 1);
+  ring_copy(out, tmp, out->len);
+  size_t end = out->len;
+  if(!final){
+    while(end > 0 && tmp[end - 1] != '\n')
+      end--;
+  }
+  int nlines = end > 0 && tmp[end - 1] != '\n';
+  for(size_t i = 0; i < end; i++){
+    if(tmp[i] == '\n')
+      nlines++;
+  }
+  SEXP res = PROTECT(Rf_allocVector(STRSXP, nlines));
+  size_t from = 0;
+  for(int i = 0; i < nlines; i++){
+    size_t to = from;
+    while(to < end && tmp[to] != '\n')
+      to++;
+    size_t len = to;
+    if(len > from && tmp[len - 1] == '\r')
+      len--;
+    SET_STRING_ELT(res, i, Rf_mkCharLen(tmp + from, len - from));
+    from = to + 1;
+  }
+  ring_consume(out, end);
+  UNPROTECT(1);
+  return res;
+}
+
+static SEXP take_raw(output_buffer * out){
+  SEXP res = Rf_allocVector(RAWSXP, out->len);
+  ring_copy(out, (char *) RAW(res), out->len);
+  ring_consume(out, out->len);
+  return res;
+}
+
+static void buffer_flush(SEXP ptr, int final){
+  output_buffer * out = own_buffer(R_ExternalPtrAddr(ptr));
+  SEXP fun = R_ExternalPtrProtected(ptr);
+  if(out == NULL || out->len == 0 || !Rf_isFunction(fun))
+    return;
+  out->last = mono_time();
+  SEXP chunk = PROTECT(out->lines ? take_lines(out, final) : take_raw(out));
+  if(Rf_length(chunk)){
+    int ok;
+    SEXP call = PROTECT(Rf_lcons(fun, Rf_lcons(chunk, R_NilValue)));
+    R_tryEval(call, R_GlobalEnv, &ok);
+    UNPROTECT(1);
+  }
+  UNPROTECT(1);
+}
+
+/* Reads all available output from the fd into the buffer. Returns the
+ * number of bytes that were read. With a callback nothing is dropped: when
+ * the buffer is full and holds no complete line, the line is delivered in
+ * parts. */
+double buffer_read(SEXP ptr, int fd){
+  output_buffer * out = get_buffer(ptr);
+  int has_callback = Rf_isFunction(R_ExternalPtrProtected(ptr));
+  static char chunk[65536];
+  ssize_t len;
+  double total = 0;
+  while ((len = read(fd, chunk, sizeof(chunk))) > 0){
+    total += len;
+    if(!has_callback){
+      ring_append(out, chunk, len);
+      continue;
+    }
+    const char * data = chunk;
+    while(len > 0){
+      if(out->len == out->cap)
+        buffer_flush(ptr, 0);
+      if(out->len == out->cap)
+        buffer_flush(ptr, 1);
+      size_t n = out->cap - out->len;
+      if(n > len)
+        n = len;
+      ring_append(out, data, n);
+      data += n;
+      len -= n;
+    }
+  }
+  if(has_callback && mono_time() - out->last >= out->interval)
+    buffer_flush(ptr, 0);
+  return total;
+}
+
+/* Called on every tick of the supervision loop, such that output that is
+ * buffered gets delivered after 'interval', also when the child is quiet */
+void buffer_tick(SEXP ptr){
+  output_buffer * out = R_ExternalPtrAddr(ptr);
+  if(out && out->owner == getpid() && mono_time() - out->last >= out->interval)
+    buffer_flush(ptr, 0);
+}
+
+/* Called when a child is done, to deliver the remaining output */
+void buffer_done(SEXP ptr){
+  buffer_flush(ptr, 1);
+}
+
+SEXP R_output_buffer(SEXP callback, SEXP cap, SEXP interval, SEXP lines){
+  double size = Rf_asReal(cap);
+  if(!R_finite(size) || size < 1)
+    Rf_error("Buffer size must be at least 1 byte");
+  output_buffer * out = calloc(1, sizeof(output_buffer));
+  out->cap = size;
+  out->size = size < 65536 ? size : 65536;
+  out->buf = scratch_alloc(out->size);
+  if(out->buf == NULL){
+    free(out);
+    Rf_error("Failed to allocate output buffer of %.0f bytes", size);
+  }
+  out->interval = Rf_asReal(interval);
+  out->lines = Rf_asLogical(lines);
+  out->last = mono_time();
+  out->owner = getpid();
+  SEXP ptr = PROTECT(R_MakeExternalPtr(out, R_NilValue, callback));
+  R_RegisterCFinalizerEx(ptr, fin_buffer, TRUE);
+  Rf_setAttrib(ptr, R_ClassSymbol, Rf_mkString("output_buffer"));
+  UNPROTECT(1);
+  return ptr;
+}
+
+/* Returns and clears the contents of the buffer */
+SEXP R_output_value(SEXP ptr){
+  output_buffer * out = get_buffer(ptr);
+  return out->lines ? take_lines(out, 1) : take_raw(out);
+}
+
+/* File targets are opened by the child itself, so the output never passes
+ * through the parent. The spec is a list(path, append, max_size, keep). */
+int is_output_file(SEXP x){
+  return TYPEOF(x) == VECSXP && Rf_inherits(x, "output_file");
+}
+
+/* Renames path to path.1, path.1 to path.2, etc, keeping at most 'keep' old files */
+static void rotate_file(const char * path, int keep){
+  if(keep < 1)
+    return;
+  char from[4096];
+  char to[4096];
+  for(int i = keep - 1; i > 0; i--){
+    snprintf(from, sizeof(from), "%s.%d", path, i);
+    snprintf(to, sizeof(to), "%s.%d", path, i + 1);
+    rename(from, to);
+  }
+  snprintf(to, sizeof(to), "%s.1", path);
+  rename(path, to);
+}
+
+/* Called in the child. Falls back on /dev/null if the file cannot be opened. */
+int output_file_open(SEXP spec){
+  const char * path = CHAR(STRING_ELT(VECTOR_ELT(spec, 0), 0));
+  int append = Rf_asLogical(VECTOR_ELT(spec, 1));
+  double max_size = Rf_asReal(VECTOR_ELT(spec, 2));
+  int keep = Rf_asInteger(VECTOR_ELT(spec, 3));
+  struct stat st;
+  if(R_finite(max_size) && stat(path, &st) == 0 && st.st_size >= max_size){
+    //without old files to keep, we start over
+    rotate_file(path, keep);
+    append = keep > 0;
+  }
+  int flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
+  int fd = open(path, flags, 0644);
+  if(fd < 0)
+    fd = open("/dev/null", O_WRONLY);
+  return fd;
+}
@@ -0,0 +1,267 @@
+#include <Rinternals.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include "supervise.h"
+
+#define r 0
+#define w 1
+
+/* A worker is a forked child that blocks on the job pipe until it gets
+ * exactly one job. After evaluating it, the worker dies like any other
+ * eval_fork() child. The pool forks a fresh replacement while the worker
+ * evaluates. If that fork fails, the slot stays empty and is filled by the
+ * next pool_eval() that gets to it. */
+typedef struct {
+  pid_t pid;
+  int job;
+  int results;
+  int out;
+  int err;
+  int shm;
+} pool_worker;
+
+typedef struct {
+  pid_t owner;
+  int size;
+  int next;
+  char * tmpdir;
+  pool_worker * workers;
+} fork_pool;
+
+typedef struct {
+  int fd;
+  SEXP job;
+} job_data;
+
+static void read_job_fn(void * data){
+  job_data * x = data;
+  x->job = unserialize_from_pipe(x->fd);
+}
+
+static void close_worker_fds(pool_worker * worker){
+  close(worker->job);
+  close(worker->results);
+  close(worker->out);
+  close(worker->err);
+  if(worker->shm >= 0)
+    close(worker->shm);
+}
+
+static void discard_worker(pool_worker * worker){
+  if(worker->pid <= 0)
+    return;
+  close_worker_fds(worker);
+  kill(-worker->pid, SIGKILL);
+  waitpid(worker->pid, NULL, 0);
+  worker->pid = 0;
+}
+
+static void worker_main(fork_pool * pool, int job, int results, int fd_out, int fd_err, int shm){
+  //idle workers should not outlive the parent
+#ifdef PR_SET_PDEATHSIG
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+#endif
+
+  //wait for a job, or for the pool to be closed
+  int ready = 0;
+  if(read(job, &ready, sizeof(ready)) < sizeof(ready))
+    raise(SIGKILL);
+
+#ifdef PR_SET_PDEATHSIG
+  prctl(PR_SET_PDEATHSIG, 0);
+#endif
+
+  //every job gets its own tempdir
+  char tmpdir[4096];
+  child_tmpdir(tmpdir, sizeof(tmpdir), pool->tmpdir);
+  child_init(tmpdir, fd_out, fd_err);
+
+  job_data data = {job, R_NilValue};
+  if(!R_ToplevelExec(read_job_fn, &data)){
+    if(send_status(results, 1) > 0)
+      serialize_to_pipe(Rf_mkString("failed to receive job in pool worker"), results);
+    raise(SIGKILL);
+  }
+  close(job);
+  SEXP task = PROTECT(data.job);
+  double threshold = Rf_asReal(VECTOR_ELT(task, 2));
+
+  //output to a file replaces the pipe (that is already in use by R_Outputfile)
+  for(int i = 0; i < 2; i++){
+    SEXP target = VECTOR_ELT(task, 3 + i);
+    int fd = i ? fd_err : fd_out;
+    if(is_output_file(target)){
+      int file = output_file_open(target);
+      dup2(file, fd);
+      close(file);
+    }
+  }
+  child_eval(VECTOR_ELT(task, 0), VECTOR_ELT(task, 1), results, fd_out, fd_err,
+             R_finite(threshold) ? shm : -1, threshold, 0);
+}
+
+/* Forks a new worker into slot i */
+static void spawn_worker(fork_pool * pool, int i){
+  int job[2];
+  int results[2];
+  int pipe_out[2];
+  int pipe_err[2];
+  bail_if(pipe(job), "create job pipe");
+  bail_if(pipe(results), "create results pipe");
+  bail_if(pipe(pipe_out) || pipe(pipe_err), "create output pipes");
+  pipe_set_size(job[r]);
+  pipe_set_size(results[r]);
+  int shm = shm_create(pool->tmpdir);
+
+  pid_t pid = fork();
+  bail_if(pid < 0, "fork()");
+
+  if(pid == 0){
+    close(job[w]);
+    close(results[r]);
+    close(pipe_out[r]);
+    close(pipe_err[r]);
+
+    //do not hold on to the pipes of the other workers, nor of the worker that
+    //is busy with a job (it is a supervised child by now)
+    for(int j = 0; j < pool->size; j++){
+      if(j != i && pool->workers[j].pid > 0)
+        close_worker_fds(&pool->workers[j]);
+    }
+    child_close_siblings();
+    worker_main(pool, job[r], results[w], pipe_out[w], pipe_err[w], shm);
+  }
+
+  close(job[r]);
+  close(results[w]);
+  pipe_set_read(pipe_out);
+  pipe_set_read(pipe_err);
+  fcntl(job[w], F_SETFD, FD_CLOEXEC);
+  pool_worker worker = {pid, job[w], results[r], pipe_out[r], pipe_err[r], shm};
+  pool->workers[i] = worker;
+}
+
+typedef struct {
+  fork_pool * pool;
+  int slot;
+} replace_data;
+
+static void replace_worker_fn(void * data){
+  replace_data * x = data;
+  spawn_worker(x->pool, x->slot);
+}
+
+static void close_pool(fork_pool * pool){
+  //do not kill the workers from within a fork that happens to run gc
+  if(pool->owner == getpid()){
+    for(int i = 0; i < pool->size; i++)
+      discard_worker(&pool->workers[i]);
+  }
+  free(pool->workers);
+  free(pool->tmpdir);
+  free(pool);
+}
+
+static void fin_pool(SEXP ptr){
+  fork_pool * pool = R_ExternalPtrAddr(ptr);
+  if(pool)
+    close_pool(pool);
+  R_ClearExternalPtr(ptr);
+}
+
+static fork_pool * get_pool(SEXP ptr){
+  if(TYPEOF(ptr) != EXTPTRSXP)
+    Rf_error("pool is not an external pointer");
+  fork_pool * pool = R_ExternalPtrAddr(ptr);
+  if(pool == NULL)
+    Rf_error("This fork pool has been closed");
+  return pool;
+}
+
+SEXP R_fork_pool(SEXP size, SEXP tmpdir){
+  int n = Rf_asInteger(size);
+  if(n < 1 || n == NA_INTEGER)
+    Rf_error("Pool size must be at least 1");
+  fork_pool * pool = calloc(1, sizeof(fork_pool));
+  pool->owner = getpid();
+  pool->size = n;
+  pool->tmpdir = strdup(CHAR(STRING_ELT(tmpdir, 0)));
+  pool->workers = calloc(n, sizeof(pool_worker));
+  SEXP ptr = PROTECT(R_MakeExternalPtr(pool, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(ptr, fin_pool, TRUE);
+  for(int i = 0; i < n; i++)
+    spawn_worker(pool, i);
+  Rf_setAttrib(ptr, R_ClassSymbol, Rf_mkString("fork_pool"));
+  UNPROTECT(1);
+  return ptr;
+}
+
+SEXP R_pool_eval(SEXP ptr, SEXP call, SEXP env, SEXP timeout, SEXP outfun, SEXP errfun, SEXP shm_threshold){
+  fork_pool * pool = get_pool(ptr);
+  int i = pool->next;
+  pool->next = (i + 1) % pool->size;
+
+  //replace the worker if it has died while idle, or if it could not be forked
+  if(pool->workers[i].pid <= 0 || waitpid(pool->workers[i].pid, NULL, WNOHANG) != 0){
+    discard_worker(&pool->workers[i]);
+    spawn_worker(pool, i);
+  }
+
+  //the worker is no longer part of the pool once it has a job
+  pool_worker worker = pool->workers[i];
+  pool->workers[i].pid = 0;
+  SEXP job = PROTECT(Rf_allocVector(VECSXP, 5));
+  SET_VECTOR_ELT(job, 0, call);
+  SET_VECTOR_ELT(job, 1, env);
+  SET_VECTOR_ELT(job, 2, shm_threshold);
+  SET_VECTOR_ELT(job, 3, is_output_file(outfun) ? outfun : R_NilValue);
+  SET_VECTOR_ELT(job, 4, is_output_file(errfun) ? errfun : R_NilValue);
+  int ready = 1;
+  if(write(worker.job, &ready, sizeof(ready)) < sizeof(ready)){
+    discard_worker(&worker);
+    spawn_worker(pool, i);
+    Rf_error("Failed to send job to pool worker");
+  }
+  serialize_to_pipe(job, worker.job);
+  close(worker.job);
+  fork_child child;
+  child_adopt(&child, worker.pid, worker.results, worker.out, worker.err, worker.shm, -1, REAL(timeout)[0]);
+
+  //fork the replacement while the worker evaluates, such that the cost of the
+  //fork overlaps with the job instead of adding to it. If the fork fails, the
+  //job still completes and the next pool_eval() tries again.
+  replace_data data = {pool, i};
+  R_ToplevelExec(replace_worker_fn, &data);
+  SEXP out = wait_for_child(call, &child, REAL(timeout)[0], outfun, errfun, R_NilValue, R_NilValue);
+  UNPROTECT(1);
+  return out;
+}
+
+SEXP R_pool_close(SEXP ptr){
+  get_pool(ptr);
+  fin_pool(ptr);
+  return R_NilValue;
+}
+
+SEXP R_pool_info(SEXP ptr){
+  fork_pool * pool = get_pool(ptr);
+  int n = 0;
+  for(int i = 0; i < pool->size; i++)
+    n += pool->workers[i].pid > 0;
+  SEXP out = Rf_allocVector(INTSXP, n);
+  for(int i = 0, j = 0; i < pool->size; i++){
+    if(pool->workers[i].pid > 0)
+      INTEGER(out)[j++] = pool->workers[i].pid;
+  }
+  return out;
+}
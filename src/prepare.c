@@ -0,0 +1,95 @@
+#include <Rinternals.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/* Defined in fork.c */
+extern void bail_if(int err, const char * what);
+
+/* Defined in events.c */
+extern double mono_time(void);
+
+/* Scratch memory that is only used by the parent, such as the ring of an
+ * output_buffer. It is mapped separately and excluded from fork(), so the
+ * children neither copy its page tables nor share its pages. Hence pointers
+ * into it are invalid in a child: the owner must check getpid() before use. */
+void * scratch_alloc(size_t size){
+  void * buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(buf == MAP_FAILED)
+    return NULL;
+#ifdef MADV_DONTFORK
+  madvise(buf, size, MADV_DONTFORK);
+#endif
+  return buf;
+}
+
+void scratch_free(void * buf, size_t size){
+  if(buf)
+    munmap(buf, size);
+}
+
+/* Applies MADV_HUGEPAGE to all private anonymous writable mappings of at
+ * least 'min_size' bytes, which is where R keeps its heap and large vectors.
+ * With transparent huge pages, fork() copies one entry per 2MB rather than
+ * one per 4KB page. Returns the number of mappings and bytes that were advised. */
+static void advise_hugepages(double min_size, double * regions, double * bytes){
+  *regions = 0;
+  *bytes = 0;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  FILE * fp = fopen("/proc/self/maps", "r");
+  bail_if(fp == NULL, "open /proc/self/maps");
+  char line[4096];
+  while(fgets(line, sizeof(line), fp)){
+    unsigned long start, end, inode;
+    char perms[8];
+    char path[4096] = "";
+    if(sscanf(line, "%lx-%lx %7s %*s %*s %lu %4095s", &start, &end, perms, &inode, path) < 4)
+      continue;
+    double size = end - start;
+    if(inode != 0 || perms[0] != 'r' || perms[1] != 'w' || perms[3] != 'p' || size < min_size)
+      continue;
+    if(path[0] && strcmp(path, "[heap]"))
+      continue;
+    if(madvise((void *) start, end - start, MADV_HUGEPAGE) == 0){
+      *regions += 1;
+      *bytes += size;
+    }
+  }
+  fclose(fp);
+#endif
+}
+
+/* Median time of fork() plus reaping a child that exits immediately */
+static double fork_cost(int n){
+  double * times = (double *) R_alloc(n, sizeof(double));
+  for(int i = 0; i < n; i++){
+    double start = mono_time();
+    pid_t pid = fork();
+    bail_if(pid < 0, "fork()");
+    if(pid == 0)
+      _exit(0);
+    waitpid(pid, NULL, 0);
+    times[i] = mono_time() - start;
+  }
+  R_rsort(times, n);
+  return times[n / 2];
+}
+
+SEXP R_fork_prepare(SEXP hugepages, SEXP min_size, SEXP measure){
+  int n = Rf_asInteger(measure);
+  SEXP out = PROTECT(Rf_allocVector(REALSXP, 4));
+  double * x = REAL(out);
+  x[0] = x[1] = 0;
+  x[2] = x[3] = NA_REAL;
+  if(n > 0)
+    x[2] = fork_cost(n);
+  if(Rf_asLogical(hugepages))
+    advise_hugepages(Rf_asReal(min_size), &x[0], &x[1]);
+  if(n > 0)
+    x[3] = fork_cost(n);
+  UNPROTECT(1);
+  return out;
+}
@@ -1,17 +1,126 @@
 #define R_NO_REMAP
 #define STRICT_R_HEADERS
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
 #include <Rinternals.h>
 #include <sys/types.h>
 #include <sys/resource.h>
 #include <unistd.h>
 #include <signal.h>
+#include <string.h>
+#include <errno.h>
 
 extern void bail_if(int err, const char * what);
 
+/* Operations on many pids return a logical vector with an 'error' attribute
+ * that holds the message for each pid that failed, rather than stopping at
+ * the first error. */
+static SEXP make_status(const int * errs, int n){
+  SEXP out = PROTECT(Rf_allocVector(LGLSXP, n));
+  SEXP msg = PROTECT(Rf_allocVector(STRSXP, n));
+  for(int i = 0; i < n; i++){
+    LOGICAL(out)[i] = errs[i] == 0;
+    SET_STRING_ELT(msg, i, errs[i] ? Rf_mkChar(strerror(errs[i])) : NA_STRING);
+  }
+  Rf_setAttrib(out, Rf_install("error"), msg);
+  UNPROTECT(2);
+  return out;
+}
+
+/* Recycles the shorter of both vectors, like R does */
+static int recycled(SEXP x, int i){
+  return INTEGER(x)[i % Rf_length(x)];
+}
+
+/* A single pid raises an error like before, many pids get a status each */
 SEXP R_kill(SEXP pid, SEXP sig){
-  bail_if(kill(Rf_asInteger(pid), Rf_asInteger(sig)) < 0, "send kill()");
+  int n = Rf_length(pid);
+  if(n == 1){
+    bail_if(kill(INTEGER(pid)[0], INTEGER(sig)[0]) < 0, "send kill()");
+    return Rf_ScalarLogical(TRUE);
+  }
+  int * errs = (int *) R_alloc(n, sizeof(int));
+  for(int i = 0; i < n; i++)
+    errs[i] = kill(INTEGER(pid)[i], recycled(sig, i)) < 0 ? errno : 0;
+  return make_status(errs, n);
+}
+
+static int prio_which(SEXP which){
+  const char * str = CHAR(STRING_ELT(which, 0));
+  if(!strcmp(str, "pgrp"))
+    return PRIO_PGRP;
+  if(!strcmp(str, "user"))
+    return PRIO_USER;
+  return PRIO_PROCESS;
+}
+
+/* getpriority() can legitimately return -1, so errno tells us if it failed */
+SEXP R_getpriority_many(SEXP ids, SEXP which){
+  int n = Rf_length(ids);
+  int type = prio_which(which);
+  SEXP out = PROTECT(Rf_allocVector(INTSXP, n));
+  for(int i = 0; i < n; i++){
+    errno = 0;
+    int prio = getpriority(type, INTEGER(ids)[i]);
+    INTEGER(out)[i] = errno ? NA_INTEGER : prio;
+  }
+  UNPROTECT(1);
+  return out;
+}
+
+SEXP R_setpriority_many(SEXP ids, SEXP prio, SEXP which){
+  int n = Rf_length(ids);
+  int type = prio_which(which);
+  int * errs = (int *) R_alloc(n, sizeof(int));
+  for(int i = 0; i < n; i++)
+    errs[i] = setpriority(type, INTEGER(ids)[i], recycled(prio, i)) < 0 ? errno : 0;
+  return make_status(errs, n);
+}
+
+/* CPUs are numbered from 0, as in taskset and /proc/cpuinfo */
+SEXP R_sched_setaffinity(SEXP pids, SEXP cpus){
+  int n = Rf_length(pids);
+  int * errs = (int *) R_alloc(n, sizeof(int));
+#if defined(__linux__) && defined(CPU_SET)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for(int i = 0; i < Rf_length(cpus); i++){
+    int cpu = INTEGER(cpus)[i];
+    if(cpu < 0 || cpu >= CPU_SETSIZE)
+      Rf_error("Invalid cpu: %d", cpu);
+    CPU_SET(cpu, &set);
+  }
+  for(int i = 0; i < n; i++)
+    errs[i] = sched_setaffinity(INTEGER(pids)[i], sizeof(set), &set) < 0 ? errno : 0;
+#else
+  for(int i = 0; i < n; i++)
+    errs[i] = ENOSYS;
+#endif
+  return make_status(errs, n);
+}
+
+SEXP R_sched_getaffinity(SEXP pid){
+#if defined(__linux__) && defined(CPU_SET)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  bail_if(sched_getaffinity(Rf_asInteger(pid), sizeof(set), &set) < 0, "sched_getaffinity()");
+  SEXP out = PROTECT(Rf_allocVector(INTSXP, CPU_COUNT(&set)));
+  int j = 0;
+  for(int i = 0; i < CPU_SETSIZE && j < Rf_length(out); i++){
+    if(CPU_ISSET(i, &set))
+      INTEGER(out)[j++] = i;
+  }
+  UNPROTECT(1);
+  return out;
+#else
+  Rf_error("sched_getaffinity() is only supported on Linux");
   return R_NilValue;
+#endif
 }
 
 SEXP R_getuid(void){
@@ -75,3 +184,24 @@ SEXP R_setpriority(SEXP prio){
   bail_if(setpriority(PRIO_PROCESS, 0, Rf_asInteger(prio)) < 0, "setpriority()");
   return R_getpriority();
 }
+
+/* Prefer memory from the given NUMA node for all future allocations of this
+ * process, as with 'numactl --preferred'. We use the syscall directly so we do
+ * not need libnuma. */
+#define MPOL_PREFERRED_MODE 1
+
+SEXP R_set_mempolicy(SEXP node){
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+  unsigned long mask[16];
+  int bits = sizeof(mask) * 8;
+  int n = Rf_asInteger(node);
+  if(n < 0 || n >= bits)
+    Rf_error("Invalid numa node: %d", n);
+  memset(mask, 0, sizeof(mask));
+  mask[n / (8 * sizeof(unsigned long))] |= 1UL << (n % (8 * sizeof(unsigned long)));
+  bail_if(syscall(SYS_set_mempolicy, MPOL_PREFERRED_MODE, mask, bits + 1) < 0, "set_mempolicy()");
+#else
+  Rf_error("NUMA memory policies are only supported on Linux");
+#endif
+  return R_NilValue;
+}
@@ -0,0 +1,206 @@
+#include <Rinternals.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+/* Defined in fork.c */
+extern void bail_if(int err, const char * what);
+
+/* Defined in events.c */
+extern double mono_time(void);
+
+#define PROC_COLUMNS 11
+
+#ifdef __linux__
+
+/* One row of the process table */
+typedef struct {
+  int pid;
+  int ppid;
+  int pgid;
+  int uid;
+  char state;
+  double utime;
+  double stime;
+  double rss;
+  int threads;
+  double start;
+  char * cmdline;
+} proc_row;
+
+typedef struct {
+  proc_row * rows;
+  int n;
+  int size;
+} proc_rows;
+
+/* NULL means no filter, an empty filter matches nothing */
+static int in_filter(SEXP filter, int value){
+  if(Rf_isNull(filter))
+    return 1;
+  int n = Rf_length(filter);
+  for(int i = 0; i < n; i++){
+    if(INTEGER(filter)[i] == value)
+      return 1;
+  }
+  return 0;
+}
+
+static double boot_time(void){
+  FILE * fp = fopen("/proc/stat", "r");
+  if(fp == NULL)
+    return NA_REAL;
+  char line[1024];
+  double btime = NA_REAL;
+  while(fgets(line, sizeof(line), fp)){
+    if(strncmp(line, "btime ", 6) == 0){
+      btime = atof(line + 6);
+      break;
+    }
+  }
+  fclose(fp);
+  return btime;
+}
+
+/* Reads a small file from /proc in one go. Returns the number of bytes. */
+static ssize_t read_proc(const char * path, char * buf, size_t size){
+  int fd = open(path, O_RDONLY);
+  if(fd < 0)
+    return -1;
+  ssize_t len = read(fd, buf, size - 1);
+  close(fd);
+  if(len >= 0)
+    buf[len] = '\0';
+  return len;
+}
+
+/* Arguments are separated by NUL bytes. Kernel threads have no cmdline, so
+ * like ps we show the name between brackets instead. */
+static char * read_cmdline(int pid, const char * comm){
+  char path[64];
+  char buf[4096];
+  snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+  ssize_t len = read_proc(path, buf, sizeof(buf));
+  if(len > 0){
+    for(ssize_t i = 0; i < len - 1; i++){
+      if(buf[i] == '\0')
+        buf[i] = ' ';
+    }
+  } else {
+    snprintf(buf, sizeof(buf), "[%s]", comm);
+    len = strlen(buf);
+  }
+  char * out = R_alloc(strlen(buf) + 1, 1);
+  strcpy(out, buf);
+  return out;
+}
+
+/* Parses /proc/[pid]/stat and adds a row if it passes the filters */
+static void read_process(proc_rows * out, int pid, SEXP ppids, SEXP pgids, SEXP uids,
+                         double ticks, double pagesize, double btime){
+  char path[64];
+  struct stat st;
+  snprintf(path, sizeof(path), "/proc/%d", pid);
+  if(stat(path, &st) < 0 || !in_filter(uids, st.st_uid))
+    return;
+  char buf[2048];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  if(read_proc(path, buf, sizeof(buf)) <= 0)
+    return;
+  //the name of the command can contain spaces and parentheses
+  char * open = strchr(buf, '(');
+  char * close = strrchr(buf, ')');
+  if(open == NULL || close == NULL)
+    return;
+  *close = '\0';
+  char state;
+  int ppid, pgid, threads;
+  unsigned long utime, stime;
+  unsigned long long starttime;
+  long rss;
+  int fields = sscanf(close + 2, "%c %d %d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d %d %*d %llu %*u %ld",
+                      &state, &ppid, &pgid, &utime, &stime, &threads, &starttime, &rss);
+  if(fields != 8 || !in_filter(ppids, ppid) || !in_filter(pgids, pgid))
+    return;
+  if(out->n == out->size){
+    int size = out->size * 2;
+    proc_row * rows = (proc_row *) R_alloc(size, sizeof(proc_row));
+    memcpy(rows, out->rows, out->n * sizeof(proc_row));
+    out->rows = rows;
+    out->size = size;
+  }
+  proc_row row = {
+    .pid = pid,
+    .ppid = ppid,
+    .pgid = pgid,
+    .uid = st.st_uid,
+    .state = state,
+    .utime = utime / ticks,
+    .stime = stime / ticks,
+    .rss = rss * pagesize,
+    .threads = threads,
+    .start = btime + starttime / ticks,
+    .cmdline = read_cmdline(pid, open + 1)
+  };
+  out->rows[out->n++] = row;
+}
+
+/* Scans /proc once. Filters on pid only read the given processes, the other
+ * filters are applied before reading the cmdline. */
+SEXP R_proc_table(SEXP pids, SEXP ppids, SEXP pgids, SEXP uids){
+  double ticks = sysconf(_SC_CLK_TCK);
+  double pagesize = sysconf(_SC_PAGESIZE);
+  double btime = boot_time();
+  double time = mono_time();
+  proc_rows out = {(proc_row *) R_alloc(256, sizeof(proc_row)), 0, 256};
+  if(!Rf_isNull(pids)){
+    for(int i = 0; i < Rf_length(pids); i++)
+      read_process(&out, INTEGER(pids)[i], ppids, pgids, uids, ticks, pagesize, btime);
+  } else {
+    DIR * dir = opendir("/proc");
+    bail_if(dir == NULL, "opendir(/proc)");
+    struct dirent * ent;
+    while((ent = readdir(dir))){
+      if(isdigit(ent->d_name[0]))
+        read_process(&out, atoi(ent->d_name), ppids, pgids, uids, ticks, pagesize, btime);
+    }
+    closedir(dir);
+  }
+  int n = out.n;
+  SEXP res = PROTECT(Rf_allocVector(VECSXP, PROC_COLUMNS));
+  SEXPTYPE types[PROC_COLUMNS] = {INTSXP, INTSXP, INTSXP, INTSXP, STRSXP, REALSXP,
+                                  REALSXP, REALSXP, INTSXP, REALSXP, STRSXP};
+  for(int j = 0; j < PROC_COLUMNS; j++)
+    SET_VECTOR_ELT(res, j, Rf_allocVector(types[j], n));
+  for(int i = 0; i < n; i++){
+    proc_row * row = &out.rows[i];
+    INTEGER(VECTOR_ELT(res, 0))[i] = row->pid;
+    INTEGER(VECTOR_ELT(res, 1))[i] = row->ppid;
+    INTEGER(VECTOR_ELT(res, 2))[i] = row->pgid;
+    INTEGER(VECTOR_ELT(res, 3))[i] = row->uid;
+    SET_STRING_ELT(VECTOR_ELT(res, 4), i, Rf_mkCharLen(&row->state, 1));
+    REAL(VECTOR_ELT(res, 5))[i] = row->utime;
+    REAL(VECTOR_ELT(res, 6))[i] = row->stime;
+    REAL(VECTOR_ELT(res, 7))[i] = row->rss;
+    INTEGER(VECTOR_ELT(res, 8))[i] = row->threads;
+    REAL(VECTOR_ELT(res, 9))[i] = row->start;
+    SET_STRING_ELT(VECTOR_ELT(res, 10), i, Rf_mkChar(row->cmdline));
+  }
+  Rf_setAttrib(res, Rf_install("time"), Rf_ScalarReal(time));
+  UNPROTECT(1);
+  return res;
+}
+
+#else
+
+SEXP R_proc_table(SEXP pids, SEXP ppids, SEXP pgids, SEXP uids){
+  Rf_error("proc_table() requires /proc and is only supported on Linux");
+  return R_NilValue;
+}
+
+#endif
@@ -8,8 +8,25 @@
 extern SEXP R_aa_change_profile(SEXP);
 extern SEXP R_aa_getcon(void);
 extern SEXP R_aa_is_enabled(void);
+extern SEXP R_cgroup_create(SEXP, SEXP);
+extern SEXP R_cgroup_enable(SEXP);
+extern SEXP R_cgroup_enter(SEXP);
+extern SEXP R_cgroup_remove(SEXP);
+extern SEXP R_cgroup_self(void);
+extern SEXP R_cgroup_stats(SEXP);
 extern SEXP R_chroot(SEXP);
-extern SEXP R_eval_fork(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP R_eval_fork(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP R_eval_fork_async(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP R_eval_fork_map(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP R_fork_cancel(SEXP);
+extern SEXP R_fork_cancelled(void);
+extern SEXP R_fork_latency(SEXP);
+extern SEXP R_fork_poll(SEXP, SEXP);
+extern SEXP R_fork_pool(SEXP, SEXP);
+extern SEXP R_fork_prepare(SEXP, SEXP, SEXP);
+extern SEXP R_fork_result(SEXP);
+extern SEXP R_fork_usage(void);
+extern SEXP R_fork_yield(SEXP);
 extern SEXP R_freeze(SEXP);
 extern SEXP R_getegid(void);
 extern SEXP R_geteuid(void);
@@ -18,10 +35,19 @@ extern SEXP R_getpgid(void);
 extern SEXP R_getpid(void);
 extern SEXP R_getppid(void);
 extern SEXP R_getpriority(void);
+extern SEXP R_getpriority_many(SEXP, SEXP);
 extern SEXP R_getuid(void);
 extern SEXP R_group_info(SEXP);
+extern SEXP R_hash_object(SEXP);
 extern SEXP R_have_apparmor(void);
+extern SEXP R_is_shared(SEXP);
 extern SEXP R_kill(SEXP, SEXP);
+extern SEXP R_output_buffer(SEXP, SEXP, SEXP, SEXP);
+extern SEXP R_output_value(SEXP);
+extern SEXP R_pool_close(SEXP);
+extern SEXP R_pool_eval(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP R_pool_info(SEXP);
+extern SEXP R_proc_table(SEXP, SEXP, SEXP, SEXP);
 extern SEXP R_rlimit_as(SEXP, SEXP);
 extern SEXP R_rlimit_core(SEXP, SEXP);
 extern SEXP R_rlimit_cpu(SEXP, SEXP);
@@ -31,8 +57,15 @@ extern SEXP R_rlimit_memlock(SEXP, SEXP);
 extern SEXP R_rlimit_nofile(SEXP, SEXP);
 extern SEXP R_rlimit_nproc(SEXP, SEXP);
 extern SEXP R_rlimit_stack(SEXP, SEXP);
+extern SEXP R_rlimits(SEXP, SEXP, SEXP, SEXP);
 extern SEXP R_safe_build(void);
+extern SEXP R_sched_getaffinity(SEXP);
+extern SEXP R_sched_setaffinity(SEXP, SEXP);
+extern SEXP R_seccomp_filter(SEXP, SEXP);
+extern SEXP R_seccomp_info(SEXP);
+extern SEXP R_seccomp_install(SEXP);
 extern SEXP R_set_interactive(SEXP);
+extern SEXP R_set_mempolicy(SEXP);
 extern SEXP R_set_rlimits(SEXP);
 extern SEXP R_set_tempdir(SEXP);
 extern SEXP R_setegid(SEXP);
@@ -40,15 +73,40 @@ extern SEXP R_seteuid(SEXP);
 extern SEXP R_setgid(SEXP);
 extern SEXP R_setpgid(SEXP);
 extern SEXP R_setpriority(SEXP);
+extern SEXP R_setpriority_many(SEXP, SEXP, SEXP);
 extern SEXP R_setuid(SEXP);
+extern SEXP R_shared_arena(SEXP, SEXP);
+extern SEXP R_spawn_exec(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP R_template_close(SEXP);
+extern SEXP R_template_eval(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP R_template_info(SEXP);
+extern SEXP R_template_serve(SEXP);
+extern SEXP R_template_start(SEXP, SEXP, SEXP);
 extern SEXP R_user_info(SEXP);
 
 static const R_CallMethodDef CallEntries[] = {
   {"R_aa_change_profile", (DL_FUNC) &R_aa_change_profile, 1},
   {"R_aa_getcon",         (DL_FUNC) &R_aa_getcon,         0},
   {"R_aa_is_enabled",     (DL_FUNC) &R_aa_is_enabled,     0},
+  {"R_cgroup_create",     (DL_FUNC) &R_cgroup_create,     2},
+  {"R_cgroup_enable",     (DL_FUNC) &R_cgroup_enable,     1},
+  {"R_cgroup_enter",      (DL_FUNC) &R_cgroup_enter,      1},
+  {"R_cgroup_remove",     (DL_FUNC) &R_cgroup_remove,     1},
+  {"R_cgroup_self",       (DL_FUNC) &R_cgroup_self,       0},
+  {"R_cgroup_stats",      (DL_FUNC) &R_cgroup_stats,      1},
   {"R_chroot",            (DL_FUNC) &R_chroot,            1},
-  {"R_eval_fork",         (DL_FUNC) &R_eval_fork,         6},
+  {"R_eval_fork",         (DL_FUNC) &R_eval_fork,         10},
+  {"R_eval_fork_async",   (DL_FUNC) &R_eval_fork_async,   10},
+  {"R_eval_fork_map",     (DL_FUNC) &R_eval_fork_map,     11},
+  {"R_fork_cancel",       (DL_FUNC) &R_fork_cancel,       1},
+  {"R_fork_cancelled",    (DL_FUNC) &R_fork_cancelled,    0},
+  {"R_fork_latency",      (DL_FUNC) &R_fork_latency,      1},
+  {"R_fork_poll",         (DL_FUNC) &R_fork_poll,         2},
+  {"R_fork_pool",         (DL_FUNC) &R_fork_pool,         2},
+  {"R_fork_prepare",      (DL_FUNC) &R_fork_prepare,      3},
+  {"R_fork_result",       (DL_FUNC) &R_fork_result,       1},
+  {"R_fork_usage",        (DL_FUNC) &R_fork_usage,        0},
+  {"R_fork_yield",        (DL_FUNC) &R_fork_yield,        1},
   {"R_freeze",            (DL_FUNC) &R_freeze,            1},
   {"R_getegid",           (DL_FUNC) &R_getegid,           0},
   {"R_geteuid",           (DL_FUNC) &R_geteuid,           0},
@@ -57,10 +115,19 @@ static const R_CallMethodDef CallEntries[] = {
   {"R_getpid",            (DL_FUNC) &R_getpid,            0},
   {"R_getppid",           (DL_FUNC) &R_getppid,           0},
   {"R_getpriority",       (DL_FUNC) &R_getpriority,       0},
+  {"R_getpriority_many",  (DL_FUNC) &R_getpriority_many,  2},
   {"R_getuid",            (DL_FUNC) &R_getuid,            0},
   {"R_group_info",        (DL_FUNC) &R_group_info,        1},
+  {"R_hash_object",       (DL_FUNC) &R_hash_object,       1},
   {"R_have_apparmor",     (DL_FUNC) &R_have_apparmor,     0},
+  {"R_is_shared",         (DL_FUNC) &R_is_shared,         1},
   {"R_kill",              (DL_FUNC) &R_kill,              2},
+  {"R_output_buffer",     (DL_FUNC) &R_output_buffer,     4},
+  {"R_output_value",      (DL_FUNC) &R_output_value,      1},
+  {"R_pool_close",        (DL_FUNC) &R_pool_close,        1},
+  {"R_pool_eval",         (DL_FUNC) &R_pool_eval,         7},
+  {"R_pool_info",         (DL_FUNC) &R_pool_info,         1},
+  {"R_proc_table",        (DL_FUNC) &R_proc_table,        4},
   {"R_rlimit_as",         (DL_FUNC) &R_rlimit_as,         2},
   {"R_rlimit_core",       (DL_FUNC) &R_rlimit_core,       2},
   {"R_rlimit_cpu",        (DL_FUNC) &R_rlimit_cpu,        2},
@@ -70,8 +137,15 @@ static const R_CallMethodDef CallEntries[] = {
   {"R_rlimit_nofile",     (DL_FUNC) &R_rlimit_nofile,     2},
   {"R_rlimit_nproc",      (DL_FUNC) &R_rlimit_nproc,      2},
   {"R_rlimit_stack",      (DL_FUNC) &R_rlimit_stack,      2},
+  {"R_rlimits",           (DL_FUNC) &R_rlimits,           4},
   {"R_safe_build",        (DL_FUNC) &R_safe_build,        0},
+  {"R_sched_getaffinity", (DL_FUNC) &R_sched_getaffinity, 1},
+  {"R_sched_setaffinity", (DL_FUNC) &R_sched_setaffinity, 2},
+  {"R_seccomp_filter",    (DL_FUNC) &R_seccomp_filter,    2},
+  {"R_seccomp_info",      (DL_FUNC) &R_seccomp_info,      1},
+  {"R_seccomp_install",   (DL_FUNC) &R_seccomp_install,   1},
   {"R_set_interactive",   (DL_FUNC) &R_set_interactive,   1},
+  {"R_set_mempolicy",     (DL_FUNC) &R_set_mempolicy,     1},
   {"R_set_rlimits",       (DL_FUNC) &R_set_rlimits,       1},
   {"R_set_tempdir",       (DL_FUNC) &R_set_tempdir,       1},
   {"R_setegid",           (DL_FUNC) &R_setegid,           1},
@@ -79,12 +153,24 @@ static const R_CallMethodDef CallEntries[] = {
   {"R_setgid",            (DL_FUNC) &R_setgid,            1},
   {"R_setpgid",           (DL_FUNC) &R_setpgid,           1},
   {"R_setpriority",       (DL_FUNC) &R_setpriority,       1},
+  {"R_setpriority_many",  (DL_FUNC) &R_setpriority_many,  3},
   {"R_setuid",            (DL_FUNC) &R_setuid,            1},
+  {"R_shared_arena",      (DL_FUNC) &R_shared_arena,      2},
+  {"R_spawn_exec",        (DL_FUNC) &R_spawn_exec,        11},
+  {"R_template_close",    (DL_FUNC) &R_template_close,    1},
+  {"R_template_eval",     (DL_FUNC) &R_template_eval,     8},
+  {"R_template_info",     (DL_FUNC) &R_template_info,     1},
+  {"R_template_serve",    (DL_FUNC) &R_template_serve,    1},
+  {"R_template_start",    (DL_FUNC) &R_template_start,    3},
   {"R_user_info",         (DL_FUNC) &R_user_info,         1},
   {NULL, NULL, 0}
 };
 
+/* Defined in arena.c */
+extern void arena_init(DllInfo *dll);
+
 attribute_visible void R_init_unix(DllInfo *dll) {
   R_registerRoutines(dll, NULL, CallEntries, NULL, NULL);
   R_useDynamicSymbols(dll, FALSE);
+  arena_init(dll);
 }
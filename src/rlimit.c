@@ -1,8 +1,15 @@
 #define R_NO_REMAP
 #define STRICT_R_HEADERS
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <Rinternals.h>
 #include <sys/resource.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
 
 extern void bail_if(int err, const char * what);
 
@@ -73,3 +80,147 @@ SEXP R_rlimit_memlock(SEXP a, SEXP b) {
   return make_navec();
 #endif
 }
+
+/* All supported limits, in the same order as parse_limits() in R. Limits that
+ * do not exist on this system have resource -1. */
+static struct {
+  const char * name;
+  int resource;
+} rlimit_table[] = {
+  {"as", RLIMIT_AS},
+  {"core", RLIMIT_CORE},
+  {"cpu", RLIMIT_CPU},
+  {"data", RLIMIT_DATA},
+  {"fsize", RLIMIT_FSIZE},
+#ifdef RLIMIT_MEMLOCK
+  {"memlock", RLIMIT_MEMLOCK},
+#else
+  {"memlock", -1},
+#endif
+#ifdef RLIMIT_MSGQUEUE
+  {"msgqueue", RLIMIT_MSGQUEUE},
+#else
+  {"msgqueue", -1},
+#endif
+#ifdef RLIMIT_NICE
+  {"nice", RLIMIT_NICE},
+#else
+  {"nice", -1},
+#endif
+  {"nofile", RLIMIT_NOFILE},
+#ifdef RLIMIT_NPROC
+  {"nproc", RLIMIT_NPROC},
+#else
+  {"nproc", -1},
+#endif
+#ifdef RLIMIT_RSS
+  {"rss", RLIMIT_RSS},
+#else
+  {"rss", -1},
+#endif
+#ifdef RLIMIT_RTPRIO
+  {"rtprio", RLIMIT_RTPRIO},
+#else
+  {"rtprio", -1},
+#endif
+#ifdef RLIMIT_SIGPENDING
+  {"sigpending", RLIMIT_SIGPENDING},
+#else
+  {"sigpending", -1},
+#endif
+  {"stack", RLIMIT_STACK}
+};
+
+#define RLIMIT_COUNT (sizeof(rlimit_table)/sizeof(rlimit_table[0]))
+
+int rlimit_count(void){
+  return RLIMIT_COUNT;
+}
+
+/* Only makes system calls, so it is also safe to use in a vfork() child.
+ * Values of 0 or NA are skipped. Returns -1 if a limit could not be set. */
+int apply_rlimits(const double * values){
+  for(int i = 0; i < RLIMIT_COUNT; i++){
+    int resource = rlimit_table[i].resource;
+    double val = values[i];
+    if(resource < 0 || val == 0 || ISNA(val))
+      continue;
+    rlim_t rlim_val = R_finite(val) ? val : RLIM_INFINITY;
+    struct rlimit lim = {rlim_val, rlim_val};
+    if(setrlimit(resource, &lim) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/* Gets or sets a limit of any process. Without prlimit() we can only do this
+ * for the current process. */
+static int rlimit_pid(pid_t pid, int resource, const struct rlimit * newlim, struct rlimit * oldlim){
+#ifdef __linux__
+  return prlimit(pid, resource, newlim, oldlim);
+#else
+  if(pid != 0 && pid != getpid()){
+    errno = ENOSYS;
+    return -1;
+  }
+  if(newlim)
+    return setrlimit(resource, newlim);
+  return getrlimit(resource, oldlim);
+#endif
+}
+
+static double from_rlim(rlim_t x){
+  return x == RLIM_INFINITY ? R_PosInf : x;
+}
+
+static rlim_t to_rlim(double x){
+  return R_finite(x) ? (rlim_t) x : RLIM_INFINITY;
+}
+
+/* Reads and optionally updates any set of limits of a process in one call.
+ * For each limit, a cur or max value of NA means it is left unchanged. */
+SEXP R_rlimits(SEXP pid, SEXP names, SEXP cur, SEXP max){
+  pid_t target = Rf_length(pid) ? Rf_asInteger(pid) : 0;
+  int n = Rf_length(names);
+  SEXP outcur = PROTECT(Rf_allocVector(REALSXP, n));
+  SEXP outmax = PROTECT(Rf_allocVector(REALSXP, n));
+  for(int i = 0; i < n; i++){
+    const char * name = CHAR(STRING_ELT(names, i));
+    int resource = -1;
+    int found = 0;
+    for(int j = 0; j < RLIMIT_COUNT; j++){
+      if(!strcmp(name, rlimit_table[j].name)){
+        resource = rlimit_table[j].resource;
+        found = 1;
+      }
+    }
+    if(!found)
+      Rf_error("Unsupported rlimit: %s", name);
+    REAL(outcur)[i] = REAL(outmax)[i] = NA_REAL;
+    if(resource < 0)
+      continue;
+    struct rlimit lim;
+    bail_if(rlimit_pid(target, resource, NULL, &lim) < 0, "prlimit() for current limits");
+    double newcur = REAL(cur)[i];
+    double newmax = REAL(max)[i];
+    if(!ISNA(newcur) || !ISNA(newmax)){
+      if(!ISNA(newcur)){
+        lim.rlim_cur = to_rlim(newcur);
+        //If max is too small, we need to try and raise it to at least cur
+        if(lim.rlim_cur > lim.rlim_max)
+          lim.rlim_max = lim.rlim_cur;
+      }
+      if(!ISNA(newmax))
+        lim.rlim_max = to_rlim(newmax);
+      bail_if(rlimit_pid(target, resource, &lim, NULL) < 0, "prlimit() to set limits");
+      bail_if(rlimit_pid(target, resource, NULL, &lim) < 0, "prlimit() for new limits");
+    }
+    REAL(outcur)[i] = from_rlim(lim.rlim_cur);
+    REAL(outmax)[i] = from_rlim(lim.rlim_max);
+  }
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(out, 0, outcur);
+  SET_VECTOR_ELT(out, 1, outmax);
+  UNPROTECT(3);
+  return out;
+}
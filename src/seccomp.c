@@ -0,0 +1,315 @@
+#include <Rinternals.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+/* Defined in fork.c */
+extern void bail_if(int err, const char * what);
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#if defined(__x86_64__) && !defined(__ILP32__)
+#define SECCOMP_ARCH AUDIT_ARCH_X86_64
+#elif defined(__i386__)
+#define SECCOMP_ARCH AUDIT_ARCH_I386
+#elif defined(__aarch64__)
+#define SECCOMP_ARCH AUDIT_ARCH_AARCH64
+#elif defined(__arm__)
+#define SECCOMP_ARCH AUDIT_ARCH_ARM
+#elif defined(__powerpc64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SECCOMP_ARCH AUDIT_ARCH_PPC64LE
+#elif defined(__powerpc64__)
+#define SECCOMP_ARCH AUDIT_ARCH_PPC64
+#elif defined(__s390x__)
+#define SECCOMP_ARCH AUDIT_ARCH_S390X
+#elif defined(__riscv) && __riscv_xlen == 64
+#define SECCOMP_ARCH AUDIT_ARCH_RISCV64
+#endif
+#endif
+
+#if defined(SECCOMP_ARCH) && defined(SECCOMP_MODE_FILTER)
+
+/* fchmodat2 is new in Linux 6.6, and may be missing from the headers of the
+ * build system while the kernel has it. Recent system calls have the same
+ * number on all of the architectures above. */
+#ifndef __NR_fchmodat2
+#define __NR_fchmodat2 452
+#endif
+
+/* Built-in profiles, which deny system calls with EPERM. The filter is a
+ * classic BPF program that is compiled once in the parent. A child installs
+ * it with prctl(), after which the kernel runs it for every system call of
+ * the child and everything that the child starts. Calls that are not listed
+ * in any of the profiles are allowed. */
+#define NO_NETWORK 1
+#define NO_EXEC 2
+#define READ_ONLY_FS 4
+
+/* Some calls are only denied depending on their arguments */
+#define DENY_ALWAYS 0
+#define DENY_WRITE_FLAGS 1
+#define DENY_NOT_UNIX 2
+
+typedef struct {
+  const char * name;
+  int nr;
+  int profile;
+  int check;
+  int arg;
+} seccomp_rule;
+
+#define RULE(call, profile, check, arg) {#call, __NR_##call, profile, check, arg}
+
+static const seccomp_rule rules[] = {
+  /* no-network: only local sockets can be created */
+  RULE(socket, NO_NETWORK, DENY_NOT_UNIX, 0),
+#ifdef __NR_socketcall
+  RULE(socketcall, NO_NETWORK, DENY_ALWAYS, 0),
+#endif
+
+  /* io_uring does I/O without any of the system calls below */
+#ifdef __NR_io_uring_setup
+  RULE(io_uring_setup, NO_NETWORK | READ_ONLY_FS, DENY_ALWAYS, 0),
+#endif
+
+  /* no-exec */
+  RULE(execve, NO_EXEC, DENY_ALWAYS, 0),
+#ifdef __NR_execveat
+  RULE(execveat, NO_EXEC, DENY_ALWAYS, 0),
+#endif
+
+  /* read-only-fs: files can be opened for reading only */
+#ifdef __NR_open
+  RULE(open, READ_ONLY_FS, DENY_WRITE_FLAGS, 1),
+#endif
+  RULE(openat, READ_ONLY_FS, DENY_WRITE_FLAGS, 2),
+#ifdef __NR_openat2
+  RULE(openat2, READ_ONLY_FS, DENY_ALWAYS, 0),
+#endif
+#ifdef __NR_creat
+  RULE(creat, READ_ONLY_FS, DENY_ALWAYS, 0),
+#endif
+#ifdef __NR_mkdir
+  RULE(mkdir, READ_ONLY_FS, DENY_ALWAYS, 0),
+#endif
+  RULE(mkdirat, READ_ONLY_FS, DENY_ALWAYS, 0),
+#ifdef __NR_rmdir
+  RULE(rmdir, READ_ONLY_FS, DENY_ALWAYS, 0),
+#endif
+#ifdef __NR_unlink
+  RULE(unlink, READ_ONLY_FS, DENY_ALWAYS, 0),
+#endif
+  RULE(unlinkat, READ_ONLY_FS, DENY_ALWAYS, 0),
+#ifdef __NR_rename
+  RULE(rename, READ_ONLY_FS, DENY_ALWAYS, 0),
+#endif
+#ifdef __NR_renameat
+  RULE(renameat, READ_ONLY_FS, DENY_ALWAYS, 0),
+#endif
+#ifdef __NR_renameat2
+  RULE(renameat2, READ_ONLY_FS, DENY_ALWAYS, 0),
+#endif
+#ifdef __NR_link
+  RULE(link, READ_ONLY_FS, DENY_ALWAYS, 0),
+#endif
+  RULE(linkat, READ_ONLY_FS, DENY_ALWAYS, 0),
+#ifdef __NR_symlink
+  RULE(symlink, READ_ONLY_FS, DENY_ALWAYS, 0),
+#endif
+  RULE(symlinkat, READ_ONLY_FS, DENY_ALWAYS, 0),
+#ifdef __NR_mknod
+  RULE(mknod, READ_ONLY_FS, DENY_ALWAYS, 0),
+#endif
+  RULE(mknodat, READ_ONLY_FS, DENY_ALWAYS, 0),
+#ifdef __NR_chmod
+  RULE(chmod, READ_ONLY_FS, DENY_ALWAYS, 0),
+#endif
+  RULE(fchmod, READ_ONLY_FS, DENY_ALWAYS, 0),
+  RULE(fchmodat, READ_ONLY_FS, DENY_ALWAYS, 0),
+  RULE(fchmodat2, READ_ONLY_FS, DENY_ALWAYS, 0),
+#ifdef __NR_chown
+  RULE(chown, READ_ONLY_FS, DENY_ALWAYS, 0),
+#endif
+#ifdef __NR_lchown
+  RULE(lchown, READ_ONLY_FS, DENY_ALWAYS, 0),
+#endif
+  RULE(fchown, READ_ONLY_FS, DENY_ALWAYS, 0),
+  RULE(fchownat, READ_ONLY_FS, DENY_ALWAYS, 0),
+  RULE(truncate, READ_ONLY_FS, DENY_ALWAYS, 0),
+#ifdef __NR_utime
+  RULE(utime, READ_ONLY_FS, DENY_ALWAYS, 0),
+#endif
+#ifdef __NR_utimes
+  RULE(utimes, READ_ONLY_FS, DENY_ALWAYS, 0),
+#endif
+#ifdef __NR_futimesat
+  RULE(futimesat, READ_ONLY_FS, DENY_ALWAYS, 0),
+#endif
+  RULE(utimensat, READ_ONLY_FS, DENY_ALWAYS, 0),
+  RULE(setxattr, READ_ONLY_FS, DENY_ALWAYS, 0),
+  RULE(lsetxattr, READ_ONLY_FS, DENY_ALWAYS, 0),
+  RULE(fsetxattr, READ_ONLY_FS, DENY_ALWAYS, 0),
+  RULE(removexattr, READ_ONLY_FS, DENY_ALWAYS, 0),
+  RULE(lremovexattr, READ_ONLY_FS, DENY_ALWAYS, 0),
+  RULE(fremovexattr, READ_ONLY_FS, DENY_ALWAYS, 0)
+};
+
+#define NRULES (sizeof(rules) / sizeof(rules[0]))
+
+/* Order should match the profiles in the R function */
+static const char * profile_names[3] = {"no-network", "no-exec", "read-only-fs"};
+
+/* Offset of the lower 32 bits of a system call argument */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define ARG_LOW(i) (offsetof(struct seccomp_data, args) + (i) * sizeof(__u64) + sizeof(__u32))
+#else
+#define ARG_LOW(i) (offsetof(struct seccomp_data, args) + (i) * sizeof(__u64))
+#endif
+
+#define WRITE_FLAGS (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC | O_APPEND)
+#define DENY (SECCOMP_RET_ERRNO | (EPERM & SECCOMP_RET_DATA))
+
+static void fin_filter(SEXP ptr){
+  struct sock_fprog * prog = R_ExternalPtrAddr(ptr);
+  if(prog == NULL)
+    return;
+  free(prog->filter);
+  free(prog);
+  R_ClearExternalPtr(ptr);
+}
+
+static int is_allowed(const char * name, SEXP allow){
+  for(int i = 0; i < Rf_length(allow); i++){
+    if(strcmp(name, CHAR(STRING_ELT(allow, i))) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/* Each rule only jumps within its own block, so the program can not run into
+ * the 255 instruction limit of the jump offsets. A rule that inspects an
+ * argument ends in a return either way, because it overwrites the syscall
+ * number in the accumulator. */
+SEXP R_seccomp_filter(SEXP profiles, SEXP allow){
+  int mask = 0;
+  for(int i = 0; i < Rf_length(profiles); i++){
+    for(int j = 0; j < 3; j++){
+      if(strcmp(CHAR(STRING_ELT(profiles, i)), profile_names[j]) == 0)
+        mask |= 1 << j;
+    }
+  }
+  for(int i = 0; i < Rf_length(allow); i++){
+    int known = 0;
+    for(int j = 0; j < NRULES; j++)
+      known = known || strcmp(CHAR(STRING_ELT(allow, i)), rules[j].name) == 0;
+    if(!known)
+      Rf_error("System call '%s' is not restricted by the built-in profiles", CHAR(STRING_ELT(allow, i)));
+  }
+  struct sock_filter * filter = malloc((6 + 5 * NRULES) * sizeof(struct sock_filter));
+  bail_if(filter == NULL, "malloc() for seccomp filter");
+  int n = 0;
+  struct sock_filter header[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SECCOMP_ARCH, 1, 0),
+    BPF_STMT(BPF_RET | BPF_K, DENY),
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr))
+  };
+  memcpy(filter, header, sizeof(header));
+  n += sizeof(header) / sizeof(header[0]);
+#ifdef __X32_SYSCALL_BIT
+  //the x32 ABI has the same arch, but different syscall numbers
+  struct sock_filter x32[] = {
+    BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, __X32_SYSCALL_BIT, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, DENY)
+  };
+  memcpy(filter + n, x32, sizeof(x32));
+  n += 2;
+#endif
+  for(int i = 0; i < NRULES; i++){
+    const seccomp_rule * rule = &rules[i];
+    if(!(rule->profile & mask) || is_allowed(rule->name, allow))
+      continue;
+    if(rule->check == DENY_ALWAYS){
+      struct sock_filter block[] = {
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, rule->nr, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, DENY)
+      };
+      memcpy(filter + n, block, sizeof(block));
+      n += 2;
+    } else {
+      struct sock_filter block[] = {
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, rule->nr, 0, 4),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, ARG_LOW(rule->arg)),
+        rule->check == DENY_WRITE_FLAGS ?
+          (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, WRITE_FLAGS, 0, 1) :
+          (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AF_UNIX, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, DENY),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW)
+      };
+      memcpy(filter + n, block, sizeof(block));
+      n += 5;
+    }
+  }
+  struct sock_filter allow_all = BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+  filter[n++] = allow_all;
+  struct sock_fprog * prog = malloc(sizeof(struct sock_fprog));
+  if(prog == NULL)
+    free(filter);
+  bail_if(prog == NULL, "malloc() for seccomp filter");
+  prog->len = n;
+  prog->filter = filter;
+  SEXP ptr = PROTECT(R_MakeExternalPtr(prog, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(ptr, fin_filter, TRUE);
+  Rf_setAttrib(ptr, R_ClassSymbol, Rf_mkString("seccomp_filter"));
+  UNPROTECT(1);
+  return ptr;
+}
+
+/* Runs in the child: the filter is inherited from the parent with fork(), so
+ * this only takes the prctl() calls. Without CAP_SYS_ADMIN, the kernel only
+ * accepts a filter from a process that can not gain privileges via exec. */
+SEXP R_seccomp_install(SEXP ptr){
+  if(TYPEOF(ptr) != EXTPTRSXP || !Rf_inherits(ptr, "seccomp_filter"))
+    Rf_error("filter is not a seccomp_filter");
+  struct sock_fprog * prog = R_ExternalPtrAddr(ptr);
+  if(prog == NULL)
+    Rf_error("This seccomp_filter is no longer valid");
+  bail_if(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0), "prctl(PR_SET_NO_NEW_PRIVS)");
+  bail_if(prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, prog), "prctl(PR_SET_SECCOMP)");
+  return R_NilValue;
+}
+
+SEXP R_seccomp_info(SEXP ptr){
+  struct sock_fprog * prog = R_ExternalPtrAddr(ptr);
+  return Rf_ScalarInteger(prog ? prog->len : NA_INTEGER);
+}
+
+#else
+
+static void seccomp_unsupported(void){
+  Rf_error("seccomp filters are only supported on Linux");
+}
+
+SEXP R_seccomp_filter(SEXP profiles, SEXP allow){
+  seccomp_unsupported();
+  return R_NilValue;
+}
+
+SEXP R_seccomp_install(SEXP ptr){
+  seccomp_unsupported();
+  return R_NilValue;
+}
+
+SEXP R_seccomp_info(SEXP ptr){
+  return Rf_ScalarInteger(NA_INTEGER);
+}
+
+#endif
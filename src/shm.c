@@ -0,0 +1,199 @@
+#include <Rinternals.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/* Shared memory transport: large results are written by the child into an
+ * anonymous file which is created by the parent before forking. The parent
+ * then maps the file instead of copying everything through the pipe. On Linux
+ * this is a memfd, elsewhere an unlinked file in the tempdir. */
+
+static const int R_DefaultSerializeVersion = 2;
+
+#define SHM_MIN_SIZE (1 << 20)
+#define HEAP_MIN_SIZE (1 << 16)
+
+/* Defined in fork.c */
+extern void bail_if(int err, const char * what);
+
+int shm_create(const char * tmpdir){
+#if defined(__linux__) && defined(SYS_memfd_create)
+  int fd = syscall(SYS_memfd_create, "eval_fork", 0);
+  if(fd >= 0)
+    return fd;
+#endif
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/shmXXXXXX", tmpdir);
+  int tmp = mkstemp(path);
+  if(tmp >= 0)
+    unlink(path);
+  return tmp;
+}
+
+/* Child side: a serialization stream into a growing buffer on the heap,
+ * which spills into a shared mapping once it exceeds the threshold. Hence
+ * small results do not pay for resizing and mapping the file. */
+typedef struct {
+  int fd;
+  double threshold;
+  char * heap;
+  char * map;
+  size_t len;
+  size_t cap;
+  int failed;
+} shm_stream;
+
+static int heap_grow(shm_stream * out, size_t size){
+  size_t cap = out->cap ? out->cap : HEAP_MIN_SIZE;
+  while(cap < size)
+    cap *= 2;
+  char * heap = realloc(out->heap, cap);
+  if(heap == NULL)
+    return -1;
+  out->heap = heap;
+  out->cap = cap;
+  return 0;
+}
+
+static int shm_grow(shm_stream * out, size_t size){
+  size_t cap = out->map ? out->cap : SHM_MIN_SIZE;
+  while(cap < size)
+    cap *= 2;
+  if(ftruncate(out->fd, cap) < 0)
+    return -1;
+  char * map = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_SHARED, out->fd, 0);
+  if(map == MAP_FAILED)
+    return -1;
+  if(out->map){
+    munmap(out->map, out->cap);
+  } else if(out->heap){
+    memcpy(map, out->heap, out->len);
+    free(out->heap);
+    out->heap = NULL;
+  }
+  out->map = map;
+  out->cap = cap;
+  return 0;
+}
+
+static void ShmOutBytesCB(R_outpstream_t stream, void * raw, int size){
+  shm_stream * out = stream->data;
+  if(out->failed)
+    return;
+  size_t need = out->len + size;
+  if(need > out->cap){
+    int spill = out->map != NULL || need > out->threshold;
+    if((spill ? shm_grow(out, need) : heap_grow(out, need)) < 0){
+      out->failed = 1;
+      return;
+    }
+  }
+  memcpy((out->map ? out->map : out->heap) + out->len, raw, size);
+  out->len += size;
+}
+
+static void ShmOutCharCB(R_outpstream_t stream, int c){
+  ShmOutBytesCB(stream, &c, sizeof(c));
+}
+
+/* Returns the serialized data, and sets 'shared' if it is in the shared
+ * mapping rather than on the heap. Returns NULL if the memory is unavailable,
+ * e.g. because of an rlimit in the child. The child never frees it. */
+void * shm_serialize(SEXP object, int fd, double threshold, size_t * len, int * shared){
+  //exceeding RLIMIT_FSIZE should make ftruncate() fail rather than kill us
+  signal(SIGXFSZ, SIG_IGN);
+  shm_stream out = {fd, threshold, NULL, NULL, 0, 0, 0};
+  struct R_outpstream_st stream;
+  R_InitOutPStream(&stream, &out, R_pstream_xdr_format, R_DefaultSerializeVersion, ShmOutCharCB, ShmOutBytesCB, NULL, R_NilValue);
+  R_Serialize(object, &stream);
+  if(out.failed){
+    if(out.map)
+      munmap(out.map, out.cap);
+    free(out.heap);
+    return NULL;
+  }
+  *len = out.len;
+  *shared = out.map != NULL;
+  return out.map ? out.map : out.heap;
+}
+
+int raw_to_shm(SEXP object, int fd){
+  signal(SIGXFSZ, SIG_IGN);
+  const char * buf = (const char *) RAW(object);
+  size_t remaining = XLENGTH(object);
+  while(remaining > 0){
+    ssize_t written = write(fd, buf, remaining);
+    if(written <= 0)
+      return -1;
+    remaining -= written;
+    buf += written;
+  }
+  return 0;
+}
+
+/* Parent side: map the data that the child has written */
+typedef struct {
+  const char * map;
+  size_t len;
+} shm_buffer;
+
+static void * shm_map(int fd, size_t len){
+  void * map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+  bail_if(map == MAP_FAILED, "mmap() shared result");
+  return map;
+}
+
+static void shm_unmap(void * data){
+  shm_buffer * buf = data;
+  munmap((void *) buf->map, buf->len);
+}
+
+static void ShmInBytesCB(R_inpstream_t stream, void * raw, int length){
+  shm_buffer * buf = stream->data;
+  if(length > buf->len)
+    Rf_error("unserialize from shared memory: unexpected end of data");
+  memcpy(raw, buf->map, length);
+  buf->map += length;
+  buf->len -= length;
+}
+
+static int ShmInCharCB(R_inpstream_t stream){
+  int val;
+  ShmInBytesCB(stream, &val, sizeof(val));
+  return val;
+}
+
+static SEXP unserialize_shm_fn(void * data){
+  shm_buffer cursor = *((shm_buffer *) data);
+  struct R_inpstream_st stream;
+  R_InitInPStream(&stream, &cursor, R_pstream_xdr_format, ShmInCharCB, ShmInBytesCB, NULL, R_NilValue);
+  return R_Unserialize(&stream);
+}
+
+SEXP unserialize_from_shm(int fd, size_t len){
+  shm_buffer buf = {shm_map(fd, len), len};
+  return R_ExecWithCleanup(unserialize_shm_fn, &buf, shm_unmap, &buf);
+}
+
+/* Unserializes data that is already in memory, such as a message */
+SEXP unserialize_buffer(const void * data, size_t len){
+  shm_buffer buf = {data, len};
+  return unserialize_shm_fn(&buf);
+}
+
+SEXP raw_from_shm(int fd, size_t len){
+  SEXP out = PROTECT(Rf_allocVector(RAWSXP, len));
+  void * map = shm_map(fd, len);
+  memcpy(RAW(out), map, len);
+  munmap(map, len);
+  UNPROTECT(1);
+  return out;
+}
@@ -0,0 +1,249 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+#include <Rinternals.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <grp.h>
+
+#include "supervise.h"
+
+#define r 0
+#define w 1
+
+#define SPAWN_STACK (64 * 1024)
+
+/* Defined in rlimit.c */
+extern int apply_rlimits(const double * values);
+
+/* Everything the child needs, prepared by the parent. On Linux the child
+ * shares the memory of the parent until it calls exec (like vfork), so it
+ * may only make system calls: no allocations, no R API. */
+typedef struct {
+  const char * path;
+  char ** argv;
+  char ** envp;
+  int fd_in;
+  int fd_out;
+  int fd_err;
+  int errpipe;
+  const double * rlimits;
+  int uid;
+  int gid;
+  sigset_t mask;
+} spawn_spec;
+
+static void close_from(int lowfd, int keep){
+#if defined(__linux__) && defined(SYS_close_range)
+  if(keep > lowfd)
+    syscall(SYS_close_range, lowfd, keep - 1, 0);
+  syscall(SYS_close_range, keep + 1, ~0U, 0);
+#endif
+}
+
+/* Drops the supplementary groups (if we may), then switches the group and
+ * user. The child of clone() shares the memory of the parent, and the libc
+ * wrappers would change the credentials of all threads they know of, i.e.
+ * those of the parent. Like posix_spawn() we make the raw system calls. */
+#if defined(__linux__) && defined(CLONE_VFORK)
+#ifdef SYS_setgid32
+#define set_groups(n, list) syscall(SYS_setgroups32, n, list)
+#define set_gid(id) syscall(SYS_setgid32, id)
+#define set_uid(id) syscall(SYS_setuid32, id)
+#else
+#define set_groups(n, list) syscall(SYS_setgroups, n, list)
+#define set_gid(id) syscall(SYS_setgid, id)
+#define set_uid(id) syscall(SYS_setuid, id)
+#endif
+#else
+#define set_groups(n, list) setgroups(n, list)
+#define set_gid(id) setgid(id)
+#define set_uid(id) setuid(id)
+#endif
+
+static int set_ids(int uid, int gid){
+  if(uid < 0 && gid < 0)
+    return 0;
+  gid_t groups[1] = {gid};
+  if(geteuid() == 0 && set_groups(gid >= 0 ? 1 : 0, groups) < 0)
+    return -1;
+  if(gid >= 0 && set_gid(gid) < 0)
+    return -1;
+  if(uid >= 0 && set_uid(uid) < 0)
+    return -1;
+  return 0;
+}
+
+static int spawn_child(void * data){
+  spawn_spec * spec = data;
+  //the parent blocked all signals, so reset the handlers of R before unblocking
+  struct sigaction dfl;
+  memset(&dfl, 0, sizeof(dfl));
+  dfl.sa_handler = SIG_DFL;
+  for(int sig = 1; sig < NSIG; sig++){
+    struct sigaction old;
+    if(sig != SIGKILL && sig != SIGSTOP && sigaction(sig, NULL, &old) == 0 && old.sa_handler != SIG_IGN)
+      sigaction(sig, &dfl, NULL);
+  }
+  sigaction(SIGPIPE, &dfl, NULL);
+  sigprocmask(SIG_SETMASK, &spec->mask, NULL);
+  if(setpgid(0, 0) < 0)
+    goto fail;
+  if(spec->fd_in >= 0 && dup2(spec->fd_in, STDIN_FILENO) < 0)
+    goto fail;
+  if(dup2(spec->fd_out, STDOUT_FILENO) < 0 || dup2(spec->fd_err, STDERR_FILENO) < 0)
+    goto fail;
+  if(spec->rlimits && apply_rlimits(spec->rlimits) < 0)
+    goto fail;
+  if(set_ids(spec->uid, spec->gid) < 0)
+    goto fail;
+  close_from(3, spec->errpipe);
+  if(spec->envp){
+    execve(spec->path, spec->argv, spec->envp);
+  } else {
+    execv(spec->path, spec->argv);
+  }
+fail:
+  {
+    int err = errno;
+    if(write(spec->errpipe, &err, sizeof(err)) < 0)
+      err = 0;
+  }
+  _exit(127);
+}
+
+/* Starts the child with clone(CLONE_VM | CLONE_VFORK) on Linux, which does not
+ * copy the page tables of the parent, so the cost does not depend on the size
+ * of the R session. Elsewhere we fall back on fork(). */
+static pid_t spawn_start(spawn_spec * spec){
+  sigset_t all;
+  sigfillset(&all);
+  sigprocmask(SIG_SETMASK, &all, &spec->mask);
+  pid_t pid;
+#if defined(__linux__) && defined(CLONE_VFORK)
+  char * stack = mmap(NULL, SPAWN_STACK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if(stack == MAP_FAILED){
+    pid = -1;
+  } else {
+    pid = clone(spawn_child, stack + SPAWN_STACK, CLONE_VM | CLONE_VFORK | SIGCHLD, spec);
+    munmap(stack, SPAWN_STACK);
+  }
+#else
+  pid = fork();
+  if(pid == 0)
+    spawn_child(spec);
+#endif
+  int err = errno;
+  sigprocmask(SIG_SETMASK, &spec->mask, NULL);
+  errno = err;
+  return pid;
+}
+
+static char ** string_array(SEXP x){
+  int n = Rf_length(x);
+  char ** out = (char **) R_alloc(n + 1, sizeof(char *));
+  for(int i = 0; i < n; i++)
+    out[i] = (char *) CHAR(STRING_ELT(x, i));
+  out[n] = NULL;
+  return out;
+}
+
+static void set_cloexec(int fd){
+  if(fd >= 0)
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+static void close_if(int fd){
+  if(fd >= 0)
+    close(fd);
+}
+
+SEXP R_spawn_exec(SEXP path, SEXP args, SEXP env, SEXP input, SEXP rlimits, SEXP uid,
+                  SEXP gid, SEXP timeout, SEXP outfun, SEXP errfun, SEXP escalate){
+  int errpipe[2];
+  int pipe_in[2] = {-1, -1};
+  int pipe_out[2];
+  int pipe_err[2];
+  bail_if(pipe(errpipe), "create error pipe");
+  bail_if(output_pipe(pipe_out, outfun) || output_pipe(pipe_err, errfun), "create output pipes");
+  if(TYPEOF(input) == RAWSXP){
+    bail_if(pipe(pipe_in), "create input pipe");
+  } else if(Rf_isString(input)){
+    pipe_in[r] = open(CHAR(STRING_ELT(input, 0)), O_RDONLY);
+    bail_if(pipe_in[r] < 0, "open stdin file");
+  } else if(input == R_NilValue){
+    pipe_in[r] = open("/dev/null", O_RDONLY);
+  }
+  int fd_out = is_output_file(outfun) ? output_file_open(outfun) : pipe_out[w];
+  int fd_err = is_output_file(errfun) ? output_file_open(errfun) : pipe_err[w];
+  int fds[] = {errpipe[r], errpipe[w], pipe_in[r], pipe_in[w], pipe_out[r], pipe_err[r], fd_out, fd_err};
+  for(int i = 0; i < sizeof(fds) / sizeof(fds[0]); i++)
+    set_cloexec(fds[i]);
+
+  spawn_spec spec = {
+    .path = CHAR(STRING_ELT(path, 0)),
+    .argv = string_array(args),
+    .envp = Rf_length(env) ? string_array(env) : NULL,
+    .fd_in = pipe_in[r],
+    .fd_out = fd_out,
+    .fd_err = fd_err,
+    .errpipe = errpipe[w],
+    .rlimits = Rf_length(rlimits) ? REAL(rlimits) : NULL,
+    .uid = Rf_length(uid) ? Rf_asInteger(uid) : -1,
+    .gid = Rf_length(gid) ? Rf_asInteger(gid) : -1
+  };
+  pid_t pid = spawn_start(&spec);
+  int spawn_errno = errno;
+
+  //the parent only keeps the read ends of the output and the write end of the input
+  close(errpipe[w]);
+  close_if(pipe_in[r]);
+  close(fd_out);
+  close(fd_err);
+  if(pid < 0){
+    close(errpipe[r]);
+    close_if(pipe_in[w]);
+    close_if(pipe_out[r]);
+    close_if(pipe_err[r]);
+    errno = spawn_errno;
+    bail_if(1, "spawn child process");
+  }
+
+  //the error pipe is closed on exec, or contains errno if the child failed
+  int exec_errno = 0;
+  if(read(errpipe[r], &exec_errno, sizeof(exec_errno)) != sizeof(exec_errno))
+    exec_errno = 0;
+  close(errpipe[r]);
+  if(exec_errno){
+    close_if(pipe_in[w]);
+    close_if(pipe_out[r]);
+    close_if(pipe_err[r]);
+    waitpid(pid, NULL, 0);
+    Rf_errorcall(R_NilValue, "Failed to execute '%s' (%s)", spec.path, strerror(exec_errno));
+  }
+  for(int i = 4; i < 6; i++){
+    if(fds[i] >= 0)
+      fcntl(fds[i], F_SETFL, O_NONBLOCK);
+  }
+  if(pipe_in[w] >= 0)
+    fcntl(pipe_in[w], F_SETFL, O_NONBLOCK);
+
+  //supervised like any other child, except that there is no result pipe
+  fork_child child;
+  child_adopt(&child, pid, -1, pipe_out[r], pipe_err[r], -1, -1, Rf_asReal(timeout));
+  child.in = pipe_in[w];
+  child.input = input;
+  child.group = 1;
+  return wait_for_child(R_NilValue, &child, Rf_asReal(timeout), outfun, errfun, R_NilValue, escalate);
+}
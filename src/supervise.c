@@ -0,0 +1,343 @@
+#include <Rinternals.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "supervise.h"
+
+#define r 0
+#define w 1
+
+/* All supervised children of this process that are still running, such that
+ * a new child does not hold on to the pipes of its siblings. Otherwise the
+ * parent would not see end-of-file on a pipe until the sibling is done too.
+ * A forked process inherits the list, but not the children in it. */
+static fork_child * running = NULL;
+static pid_t running_owner = 0;
+
+static fork_child * running_children(void){
+  if(running_owner != getpid()){
+    running = NULL;
+    running_owner = getpid();
+  }
+  return running;
+}
+
+static void close_fd(int * fd){
+  if(*fd >= 0)
+    close(*fd);
+  *fd = -1;
+}
+
+static void close_fds(fork_child * child){
+  close_fd(&child->results);
+  close_fd(&child->out);
+  close_fd(&child->err);
+  close_fd(&child->shm);
+  close_fd(&child->pidfd);
+  close_fd(&child->control);
+  close_fd(&child->in);
+  close_fd(&child->reaper);
+}
+
+static void unregister_child(fork_child * child){
+  running_children();
+  for(fork_child ** x = &running; *x; x = &(*x)->next){
+    if(*x == child){
+      *x = child->next;
+      break;
+    }
+  }
+  child->next = NULL;
+}
+
+/* Closes the pipes of all running children, in a process that was just
+ * forked and does not supervise them */
+void child_close_siblings(void){
+  for(fork_child * x = running_children(); x; x = x->next)
+    close_fds(x);
+  running = NULL;
+}
+
+/* Starts supervising a child that was forked elsewhere, with the read ends
+ * of its pipes (or -1). The output pipes must be non-blocking. The child
+ * times out after 'timeout' seconds (if > 0). */
+void child_adopt(fork_child * child, pid_t pid, int results, int out, int err, int shm, int control,
+                 double timeout){
+  double start = mono_time();
+  fork_child x = {
+    .pid = pid,
+    .results = results,
+    .out = out,
+    .err = err,
+    .shm = shm,
+    .pidfd = pidfd_open_child(pid),
+    .control = control,
+    .in = -1,
+    .input = R_NilValue,
+    .reaper = -1,
+    .start = start,
+    .deadline = timeout > 0 ? start + timeout : 0,
+    .next = running_children()
+  };
+  *child = x;
+  running = child;
+}
+
+/* Forks a child with pipes for the result and output, and a control pipe if
+ * the escalation policy needs one. Returns 0 in the child, which is ready to
+ * evaluate with child_eval() using the fds in 'child'. If 'subdir' is set,
+ * the child creates its own tempdir within 'tmpdir'. Returns the pid in the
+ * parent, where the child times out after 'timeout' seconds (if > 0). */
+pid_t child_start(fork_child * child, const char * tmpdir, int subdir, SEXP outfun, SEXP errfun,
+                  SEXP policy, double threshold, double timeout){
+  int results[2];
+  int pipe_out[2];
+  int pipe_err[2];
+  int control[2];
+  bail_if(pipe(results), "create results pipe");
+  bail_if(output_pipe(pipe_out, outfun) || output_pipe(pipe_err, errfun), "create output pipes");
+  bail_if(control_pipe(control, policy), "create control pipe");
+  pipe_set_size(results[r]);
+  int shm = R_finite(threshold) ? shm_create(tmpdir) : -1;
+
+  pid_t pid = fork();
+  bail_if(pid < 0, "fork()");
+
+  if(pid == 0){
+    close(results[r]);
+    control_child(control);
+    child_close_siblings();
+    char dir[4096];
+    if(subdir){
+      child_tmpdir(dir, sizeof(dir), tmpdir);
+    } else {
+      snprintf(dir, sizeof(dir), "%s", tmpdir);
+    }
+    child->pid = 0;
+    child->results = results[w];
+    child->out = child_output(pipe_out[w], outfun);
+    child->err = child_output(pipe_err[w], errfun);
+    child->shm = shm;
+    child_init(dir, child->out, child->err);
+    return 0;
+  }
+
+  close(results[w]);
+  pipe_set_read(pipe_out);
+  pipe_set_read(pipe_err);
+  child_adopt(child, pid, results[r], pipe_out[r], pipe_err[r], shm, control_parent(control), timeout);
+  return pid;
+}
+
+/* Reaps the child and returns its resource usage. The child kills itself
+ * after sending the result, so normally the signal is SIGKILL. The 'stage' is
+ * the number of escalation steps that the parent took to stop the child. A
+ * child of a template is reaped by the template, which sends back its status
+ * and usage over the 'reaper' socket. */
+static SEXP reap_child(pid_t pid, int reaper, double start, double out_bytes, double err_bytes,
+                       double result_bytes, double result_size, int stage){
+  int status = 0;
+  struct rusage usage;
+  memset(&usage, 0, sizeof(usage));
+  if(reaper >= 0){
+    if(template_reap(reaper, &status, &usage) < 0)
+      status = 0;
+    close(reaper);
+  } else if(wait4(pid, &status, 0, &usage) < 0){
+    status = 0;
+  }
+  double wall = mono_time() - start;
+  SEXP out = PROTECT(Rf_allocVector(REALSXP, 15));
+  double * x = REAL(out);
+  x[0] = wall;
+  x[1] = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+  x[2] = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+#ifdef __APPLE__
+  x[3] = usage.ru_maxrss;
+#else
+  x[3] = usage.ru_maxrss * 1024.0;
+#endif
+  x[4] = usage.ru_minflt;
+  x[5] = usage.ru_majflt;
+  x[6] = usage.ru_nvcsw;
+  x[7] = usage.ru_nivcsw;
+  x[8] = WIFSIGNALED(status) ? WTERMSIG(status) : NA_REAL;
+  x[9] = WIFEXITED(status) ? WEXITSTATUS(status) : NA_REAL;
+  x[10] = out_bytes;
+  x[11] = err_bytes;
+  x[12] = result_bytes;
+  x[13] = result_bytes > 0 ? result_size / result_bytes : NA_REAL;
+  x[14] = stage;
+  UNPROTECT(1);
+  return out;
+}
+
+/* Closes the pipes, kills what is left of the process group and reaps the
+ * child. Returns its resource usage, see reap_child(). */
+static SEXP child_close(fork_child * child, double result_bytes, double result_size){
+  unregister_child(child);
+  int reaper = child->reaper;
+  child->reaper = -1;
+  close_fds(child);
+  if(child->killcount)
+    stats_kill(child->firstkill, child->killcount);
+  kill(-child->pid, SIGKILL); //kills entire process group
+  SEXP usage = reap_child(child->pid, reaper, child->start, child->out_bytes, child->err_bytes,
+                          result_bytes, result_size, child->killcount);
+  child->pid = 0;
+  return usage;
+}
+
+/* Stops a child without reading its result or remaining output */
+SEXP child_kill(fork_child * child){
+  return child_close(child, 0, 0);
+}
+
+void child_pollfds(fork_child * child, struct pollfd * fds){
+  short events = POLLIN | POLLERR | POLLHUP;
+  struct pollfd x[FDS_PER_CHILD] = {
+    {child->results, events, 0},
+    {child->out, events, 0},
+    {child->err, events, 0},
+    {child->pidfd, events, 0},
+    {child->in, POLLOUT, 0}
+  };
+  for(int i = 0; i < FDS_PER_CHILD; i++)
+    fds[i] = x[i];
+}
+
+/* Writes as much of the input as the pipe takes. Returns 1 when done. */
+static int write_input(int fd, SEXP input, size_t * offset){
+  struct sigaction ign, old;
+  memset(&ign, 0, sizeof(ign));
+  ign.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &ign, &old);
+  size_t len = XLENGTH(input);
+  ssize_t n = 0;
+  while(*offset < len && (n = write(fd, RAW(input) + *offset, len - *offset)) > 0)
+    *offset += n;
+  sigaction(SIGPIPE, &old, NULL);
+  return *offset >= len || (n < 0 && errno != EAGAIN && errno != EINTR);
+}
+
+/* Streams input and output for the events from child_pollfds(), and delivers buffered
+ * output whose interval has passed. An output pipe that the child has closed
+ * is drained and closed, so that it is no longer polled, as is the input pipe
+ * once all input is written. */
+void child_read_output(fork_child * child, struct pollfd * fds, SEXP outfun, SEXP errfun){
+  if(fds[4].revents && write_input(child->in, child->input, &child->in_offset))
+    close_fd(&child->in);
+  if(fds[1].revents)
+    child->out_bytes += print_output(child->out, outfun);
+  if(fds[2].revents)
+    child->err_bytes += print_output(child->err, errfun);
+  if(fds[1].revents & POLLHUP)
+    close_fd(&child->out);
+  if(fds[2].revents & POLLHUP)
+    close_fd(&child->err);
+  print_output_tick(outfun);
+  print_output_tick(errfun);
+}
+
+static int child_exited(pid_t pid){
+  siginfo_t info;
+  memset(&info, 0, sizeof(info));
+  return waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == pid;
+}
+
+/* Whether the events from child_pollfds() call for child_finish(): either
+ * CHILD_GONE if the child has exited, or CHILD_RESULT if there is something
+ * on the results pipe. Returns 0 otherwise. Without a pidfd, a child that
+ * has no result pipe is checked for exit directly. */
+int child_ready(fork_child * child, struct pollfd * fds){
+  if(fds[3].revents)
+    return CHILD_GONE;
+  if(fds[0].revents)
+    return CHILD_RESULT;
+  if(child->pidfd < 0 && child->results < 0 && child_exited(child->pid))
+    return CHILD_GONE;
+  return 0;
+}
+
+/* Delivers all output that is left in the pipes */
+void child_flush_output(fork_child * child, SEXP outfun, SEXP errfun){
+  child->out_bytes += print_output(child->out, outfun);
+  child->err_bytes += print_output(child->err, errfun);
+  print_output_done(outfun);
+  print_output_done(errfun);
+}
+
+/* The moment of the next timeout or escalation step, or 0 if there is none */
+double child_deadline(fork_child * child){
+  return child->killcount ? child->nextkill : child->deadline;
+}
+
+/* Stops the child as if it timed out at 'time', such that child_timeout()
+ * takes it through the escalation policy */
+void child_cancel(fork_child * child, double time){
+  if(child->killcount)
+    return;
+  child->cancelled = 1;
+  child->deadline = time;
+}
+
+/* Takes the next step of the escalation policy, if it is time. Returns 1 if
+ * the child should be given up on, in which case the SIGKILL to the process
+ * group counts as one more step. */
+int child_timeout(fork_child * child, SEXP policy, double time){
+  if(child->deadline == 0 || time < child_deadline(child))
+    return 0;
+  if(child->killcount == 0 && !child->cancelled)
+    stats_timeout(child->deadline);
+  if(child->killcount >= escalate_steps(policy)){
+    child->killcount++;
+    return 1;
+  }
+  if(child->killcount == 0)
+    child->firstkill = time;
+  pid_t target = child->group ? -child->pid : child->pid;
+  child->nextkill = escalate_step(policy, child->killcount, target, child->control, time);
+  child->killcount++;
+  return 0;
+}
+
+static int results_ready(int fd){
+  if(fd < 0)
+    return 0;
+  struct pollfd ufds = {fd, POLLIN | POLLERR | POLLHUP, 0};
+  return poll(&ufds, 1, 0) > 0;
+}
+
+/* Reads the result if there is one, delivers the remaining output and reaps
+ * the child. Returns a list with the value and usage, and sets 'status' to
+ * one of the CHILD_ codes. Returns NULL if there were only messages from
+ * fork_yield(), unless the child must end regardless. */
+SEXP child_finish(fork_child * child, int force, SEXP outfun, SEXP errfun, SEXP yieldfun, int * status){
+  int fail = -1;
+  double result_bytes = 0;
+  double result_size = 0;
+  SEXP res = results_ready(child->results) ?
+    read_child_result(child->results, child->shm, &fail, &result_bytes, &result_size, yieldfun) : R_NilValue;
+  if(fail == YIELD_PENDING && !force)
+    return NULL;
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(out, 0, res);
+  child_flush_output(child, outfun, errfun);
+  if(fail == 0){
+    *status = CHILD_OK;
+  } else if(child->killcount){
+    *status = CHILD_TIMEOUT;
+  } else if(isString(res) && Rf_length(res)){
+    *status = CHILD_ERROR;
+  } else {
+    *status = CHILD_DIED;
+  }
+  SET_VECTOR_ELT(out, 1, child_close(child, result_bytes, result_size));
+  UNPROTECT(1);
+  return out;
+}
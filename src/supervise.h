@@ -0,0 +1,119 @@
+#include <Rinternals.h>
+#include <sys/types.h>
+#include <poll.h>
+#include <sys/resource.h>
+
+/* Shared by the files that start and supervise children: fork.c, supervise.c,
+ * async.c, map.c, pool.c, template.c and spawn.c. */
+
+/* A child that the parent supervises with the child_* functions below. A
+ * child with pid 0 is not running. A child from spawn_exec() has no result
+ * pipe, may have 'input' to write to its stdin, and is signalled as a
+ * process group. A child of a template is reaped through the 'reaper'
+ * socket. */
+typedef struct fork_child {
+  pid_t pid;
+  int results;
+  int out;
+  int err;
+  int shm;
+  int pidfd;
+  int control;
+  int in;
+  SEXP input;
+  size_t in_offset;
+  int group;
+  int reaper;
+  int cancelled;
+  int killcount;
+  double start;
+  double deadline;
+  double firstkill;
+  double nextkill;
+  double out_bytes;
+  double err_bytes;
+  struct fork_child * next;
+} fork_child;
+
+/* Number of pollfd entries per child: results, stdout, stderr, pidfd and stdin */
+#define FDS_PER_CHILD 5
+
+/* How a child has ended, must match the R functions */
+#define CHILD_OK 0
+#define CHILD_ERROR 1
+#define CHILD_TIMEOUT 2
+#define CHILD_DIED 3
+
+/* What child_ready() found: the result pipe is ready, or the child is gone */
+#define CHILD_RESULT 1
+#define CHILD_GONE 2
+
+/* Status of a message from fork_yield(), and the status of the result as
+ * long as only such messages have arrived */
+#define YIELD_STATUS 1990
+#define YIELD_PENDING -2
+
+/* Defined in supervise.c */
+extern pid_t child_start(fork_child * child, const char * tmpdir, int subdir, SEXP outfun, SEXP errfun,
+                         SEXP policy, double threshold, double timeout);
+extern void child_adopt(fork_child * child, pid_t pid, int results, int out, int err, int shm, int control,
+                        double timeout);
+extern void child_close_siblings(void);
+extern SEXP child_kill(fork_child * child);
+extern void child_pollfds(fork_child * child, struct pollfd * fds);
+extern void child_read_output(fork_child * child, struct pollfd * fds, SEXP outfun, SEXP errfun);
+extern void child_flush_output(fork_child * child, SEXP outfun, SEXP errfun);
+extern int child_ready(fork_child * child, struct pollfd * fds);
+extern double child_deadline(fork_child * child);
+extern void child_cancel(fork_child * child, double time);
+extern int child_timeout(fork_child * child, SEXP policy, double time);
+extern SEXP child_finish(fork_child * child, int force, SEXP outfun, SEXP errfun, SEXP yieldfun, int * status);
+
+/* Defined in fork.c */
+extern void bail_if(int err, const char * what);
+extern int pending_interrupt(void);
+extern void pipe_set_read(int pipe[2]);
+extern void pipe_set_size(int fd);
+extern int output_pipe(int fds[2], SEXP target);
+extern int child_output(int fd, SEXP target);
+extern double print_output(int fd, SEXP fun);
+extern void print_output_tick(SEXP fun);
+extern void print_output_done(SEXP fun);
+extern void child_tmpdir(char * buf, size_t size, const char * parent);
+extern void child_init(const char * tmpdir, int fd_out, int fd_err);
+extern void child_eval(SEXP call, SEXP env, int results, int fd_out, int fd_err, int shm, double threshold,
+                       int compress);
+extern ssize_t send_status(int results, int fail);
+extern void serialize_to_pipe(SEXP object, int fd);
+extern SEXP unserialize_from_pipe(int fd);
+extern SEXP read_child_result(int results, int shm, int * fail, double * bytes, double * decoded,
+                              SEXP yieldfun);
+extern void set_last_usage(SEXP usage);
+extern SEXP wait_for_child(SEXP call, fork_child * child, double timeout, SEXP outfun, SEXP errfun,
+                           SEXP yieldfun, SEXP policy);
+
+/* Defined in events.c */
+extern double mono_time(void);
+extern int pidfd_open_child(pid_t pid);
+extern int timer_create_fd(void);
+extern void timer_set(int fd, double deadline);
+extern int timer_poll_ms(int fd, double deadline);
+extern void stats_timeout(double deadline);
+extern void stats_kill(double first_signal, int stage);
+
+/* Defined in escalate.c */
+extern int escalate_steps(SEXP policy);
+extern double escalate_step(SEXP policy, int step, pid_t pid, int control, double now);
+extern int control_pipe(int fds[2], SEXP policy);
+extern int control_parent(int fds[2]);
+extern void control_child(int fds[2]);
+
+/* Defined in output.c */
+extern int is_output_file(SEXP x);
+extern int output_file_open(SEXP spec);
+
+/* Defined in template.c */
+extern int template_reap(int sock, int * status, struct rusage * usage);
+
+/* Defined in shm.c */
+extern int shm_create(const char * tmpdir);
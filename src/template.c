@@ -0,0 +1,411 @@
+#include <Rinternals.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <spawn.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include "supervise.h"
+
+#define r 0
+#define w 1
+
+/* Max number of fds sent with a job: job, results, stdout, stderr, shm */
+#define TEMPLATE_FDS 5
+
+/* A session or template that has gone away should not kill the other with SIGPIPE */
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+extern char ** environ;
+
+/* A template is a separate R process that was started from scratch, loaded
+ * some packages and data, and then only forks children on request. Requests
+ * come in over a unix socket, together with the pipes for the child. The
+ * connection stays open while the session supervises the child: once the
+ * session is done with it, the template reaps the child and sends back its
+ * status and usage. Until then the pid of the child cannot be reused. */
+typedef struct {
+  pid_t owner;
+  pid_t pid;
+  char * path;
+} fork_template;
+
+static int socket_address(struct sockaddr_un * addr, const char * path){
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(addr->sun_path))
+    return -1;
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+static int socket_connect(const char * path){
+  struct sockaddr_un addr;
+  if(socket_address(&addr, path) < 0)
+    return -1;
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(sock < 0)
+    return -1;
+  if(connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0){
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+/* Sends the fds for the child with SCM_RIGHTS */
+static int send_fds(int sock, int * fds, int n){
+  char byte = n;
+  struct iovec iov = {&byte, 1};
+  char control[CMSG_SPACE(TEMPLATE_FDS * sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+  struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+  return sendmsg(sock, &msg, 0) < 0 ? -1 : 0;
+}
+
+/* Returns the number of fds that were received */
+static int recv_fds(int sock, int * fds){
+  char byte = 0;
+  struct iovec iov = {&byte, 1};
+  char control[CMSG_SPACE(TEMPLATE_FDS * sizeof(int))];
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if(recvmsg(sock, &msg, 0) <= 0)
+    return 0;
+  struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+  if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    return 0;
+  int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  if(n > TEMPLATE_FDS)
+    n = TEMPLATE_FDS;
+  memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+  return n;
+}
+
+/*** Inside the template process ***/
+
+typedef struct {
+  int fd;
+  SEXP job;
+} job_data;
+
+/* What the template sends back once it has reaped a child */
+typedef struct {
+  int status;
+  struct rusage usage;
+} template_exit;
+
+static void read_job_fn(void * data){
+  job_data * x = data;
+  x->job = unserialize_from_pipe(x->fd);
+}
+
+static void write_job_fn(void * data){
+  job_data * x = data;
+  serialize_to_pipe(x->job, x->fd);
+}
+
+/* The job is read by the child rather than the template, so that the heap
+ * of the template stays the same for all children. */
+static void template_child(int * fds, int n){
+  job_data data = {fds[0], R_NilValue};
+  if(!R_ToplevelExec(read_job_fn, &data)){
+    if(send_status(fds[1], 1) > 0)
+      serialize_to_pipe(Rf_mkString("failed to receive job in template"), fds[1]);
+    raise(SIGKILL);
+  }
+  close(fds[0]);
+  SEXP job = PROTECT(data.job);
+  double threshold = Rf_asReal(VECTOR_ELT(job, 2));
+  char tmpdir[4096];
+  child_tmpdir(tmpdir, sizeof(tmpdir), CHAR(STRING_ELT(VECTOR_ELT(job, 3), 0)));
+  for(int i = 0; i < 2; i++){
+    SEXP target = VECTOR_ELT(job, 4 + i);
+    if(is_output_file(target)){
+      int file = output_file_open(target);
+      dup2(file, fds[2 + i]);
+      close(file);
+    }
+  }
+  child_init(tmpdir, fds[2], fds[3]);
+  child_eval(VECTOR_ELT(job, 0), VECTOR_ELT(job, 1), fds[1], fds[2], fds[3],
+             n > 4 && R_finite(threshold) ? fds[4] : -1, threshold, 0);
+}
+
+/* Children of the template, each with the connection of the session that
+ * supervises it */
+typedef struct {
+  pid_t pid;
+  int conn;
+} template_served;
+
+/* Kills and reaps a child once the session is done with it (or has gone
+ * away), and sends back its status and usage */
+static void template_release(template_served * x){
+  template_exit info;
+  memset(&info, 0, sizeof(info));
+  kill(-x->pid, SIGKILL);
+  if(wait4(x->pid, &info.status, 0, &info.usage) < 0)
+    info.status = 0;
+  if(send(x->conn, &info, sizeof(info), SEND_FLAGS) < 0)
+    info.status = 0;
+  close(x->conn);
+}
+
+SEXP R_template_serve(SEXP path){
+  //the template should not outlive the session that started it
+#ifdef PR_SET_PDEATHSIG
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+#endif
+  struct sockaddr_un addr;
+  bail_if(socket_address(&addr, CHAR(STRING_ELT(path, 0))) < 0, "socket path too long");
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  bail_if(sock < 0, "socket()");
+  unlink(addr.sun_path);
+  bail_if(bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0, "bind()");
+  bail_if(listen(sock, 64) < 0, "listen()");
+  int size = 0;
+  int cap = 16;
+  template_served * served = malloc(cap * sizeof(template_served));
+  struct pollfd * ufds = malloc((cap + 1) * sizeof(struct pollfd));
+  bail_if(served == NULL || ufds == NULL, "malloc() for template");
+  while(1){
+    //wait for a new request, or for a session that is done with its child
+    ufds[0].fd = sock;
+    ufds[0].events = POLLIN;
+    for(int i = 0; i < size; i++){
+      ufds[i + 1].fd = served[i].conn;
+      ufds[i + 1].events = POLLIN;
+    }
+    if(poll(ufds, size + 1, -1) < 0){
+      bail_if(errno != EINTR, "poll() in template");
+      continue;
+    }
+    for(int i = size - 1; i >= 0; i--){
+      if(ufds[i + 1].revents){
+        template_release(&served[i]);
+        served[i] = served[--size];
+      }
+    }
+    if(!ufds[0].revents)
+      continue;
+    int conn = accept(sock, NULL, NULL);
+    if(conn < 0 && errno == EINTR)
+      continue;
+    bail_if(conn < 0, "accept()");
+    int fds[TEMPLATE_FDS];
+    int n = recv_fds(conn, fds);
+    if(n < 4){
+      for(int i = 0; i < n; i++)
+        close(fds[i]);
+      close(conn);
+      continue;
+    }
+    pid_t pid = fork();
+    if(pid == 0){
+      close(sock);
+      close(conn);
+      for(int i = 0; i < size; i++)
+        close(served[i].conn);
+      template_child(fds, n);
+    }
+    for(int i = 0; i < n; i++)
+      close(fds[i]);
+    if(pid < 0 || send(conn, &pid, sizeof(pid), SEND_FLAGS) < 0){
+      template_served x = {pid, conn};
+      if(pid > 0)
+        template_release(&x);
+      else
+        close(conn);
+      continue;
+    }
+    if(size == cap){
+      cap *= 2;
+      served = realloc(served, cap * sizeof(template_served));
+      ufds = realloc(ufds, (cap + 1) * sizeof(struct pollfd));
+      bail_if(served == NULL || ufds == NULL, "realloc() for template");
+    }
+    template_served x = {pid, conn};
+    served[size++] = x;
+  }
+  return R_NilValue;
+}
+
+/*** In the main session ***/
+
+static void fin_template(SEXP ptr){
+  fork_template * tpl = R_ExternalPtrAddr(ptr);
+  if(tpl == NULL)
+    return;
+  if(tpl->owner == getpid() && tpl->pid > 0){
+    kill(tpl->pid, SIGKILL);
+    waitpid(tpl->pid, NULL, 0);
+    unlink(tpl->path);
+  }
+  free(tpl->path);
+  free(tpl);
+  R_ClearExternalPtr(ptr);
+}
+
+static fork_template * get_template(SEXP ptr){
+  if(TYPEOF(ptr) != EXTPTRSXP)
+    Rf_error("template is not an external pointer");
+  fork_template * tpl = R_ExternalPtrAddr(ptr);
+  if(tpl == NULL)
+    Rf_error("This fork template has been closed");
+  return tpl;
+}
+
+/* Starts the template process and waits until it accepts connections */
+SEXP R_template_start(SEXP args, SEXP path, SEXP timeout){
+  int n = Rf_length(args);
+  char ** argv = (char **) R_alloc(n + 1, sizeof(char *));
+  for(int i = 0; i < n; i++)
+    argv[i] = (char *) CHAR(STRING_ELT(args, i));
+  argv[n] = NULL;
+  //own process group, such that interrupts in the terminal do not reach it
+  pid_t pid;
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+  posix_spawnattr_setpgroup(&attr, 0);
+  errno = posix_spawn(&pid, argv[0], NULL, &attr, argv, environ);
+  posix_spawnattr_destroy(&attr);
+  bail_if(errno != 0, "posix_spawn() template process");
+  fork_template * tpl = calloc(1, sizeof(fork_template));
+  tpl->owner = getpid();
+  tpl->pid = pid;
+  tpl->path = strdup(CHAR(STRING_ELT(path, 0)));
+  SEXP ptr = PROTECT(R_MakeExternalPtr(tpl, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(ptr, fin_template, TRUE);
+  Rf_setAttrib(ptr, R_ClassSymbol, Rf_mkString("fork_template"));
+
+  //wait for the template to load everything and start listening
+  struct timespec pause = {0, 10000000};
+  int attempts = Rf_asReal(timeout) * 100;
+  for(int i = 0; i < attempts; i++){
+    int sock = socket_connect(tpl->path);
+    if(sock >= 0){
+      close(sock);
+      UNPROTECT(1);
+      return ptr;
+    }
+    if(waitpid(pid, NULL, WNOHANG) != 0){
+      tpl->pid = 0;
+      Rf_error("Template process failed to start");
+    }
+    if(pending_interrupt()){
+      fin_template(ptr);
+      Rf_error("Interrupted while starting template process");
+    }
+    nanosleep(&pause, NULL);
+  }
+  fin_template(ptr);
+  Rf_error("Template process did not start within %f seconds", Rf_asReal(timeout));
+}
+
+SEXP R_template_eval(SEXP ptr, SEXP call, SEXP env, SEXP subtmp, SEXP timeout, SEXP outfun,
+                     SEXP errfun, SEXP shm_threshold){
+  fork_template * tpl = get_template(ptr);
+  int sock = socket_connect(tpl->path);
+  bail_if(sock < 0, "connect to template process");
+  int job[2];
+  int results[2];
+  int pipe_out[2];
+  int pipe_err[2];
+  bail_if(pipe(job), "create job pipe");
+  bail_if(pipe(results), "create results pipe");
+  bail_if(pipe(pipe_out) || pipe(pipe_err), "create output pipes");
+  pipe_set_size(job[r]);
+  pipe_set_size(results[r]);
+  double threshold = Rf_asReal(shm_threshold);
+  int shm = R_finite(threshold) ? shm_create(CHAR(STRING_ELT(subtmp, 0))) : -1;
+
+  //hand the pipe ends to the template, which passes them on to the child
+  int fds[TEMPLATE_FDS] = {job[r], results[w], pipe_out[w], pipe_err[w], shm};
+  int sent = send_fds(sock, fds, shm >= 0 ? 5 : 4);
+  close(job[r]);
+  close(results[w]);
+  pipe_set_read(pipe_out);
+  pipe_set_read(pipe_err);
+  pid_t pid = 0;
+  if(sent < 0 || read(sock, &pid, sizeof(pid)) < sizeof(pid) || pid <= 0){
+    close(sock);
+    close(job[w]);
+    close(results[r]);
+    close(pipe_out[r]);
+    close(pipe_err[r]);
+    if(shm >= 0)
+      close(shm);
+    Rf_error("Failed to fork from template process");
+  }
+
+  //the job goes directly to the child, which reports it if the job got lost
+  job_data data = {job[w], PROTECT(Rf_allocVector(VECSXP, 6))};
+  SET_VECTOR_ELT(data.job, 0, call);
+  SET_VECTOR_ELT(data.job, 1, env);
+  SET_VECTOR_ELT(data.job, 2, shm_threshold);
+  SET_VECTOR_ELT(data.job, 3, subtmp);
+  SET_VECTOR_ELT(data.job, 4, is_output_file(outfun) ? outfun : R_NilValue);
+  SET_VECTOR_ELT(data.job, 5, is_output_file(errfun) ? errfun : R_NilValue);
+  R_ToplevelExec(write_job_fn, &data);
+  close(job[w]);
+
+  //the connection stays open until the template has reaped the child
+  fork_child child;
+  child_adopt(&child, pid, results[r], pipe_out[r], pipe_err[r], shm, -1, REAL(timeout)[0]);
+  child.reaper = sock;
+  SEXP out = wait_for_child(call, &child, REAL(timeout)[0], outfun, errfun, R_NilValue, R_NilValue);
+  UNPROTECT(1);
+  return out;
+}
+
+/* Tells the template that the session is done with the child, and reads
+ * back its status and usage once the template has reaped it */
+int template_reap(int sock, int * status, struct rusage * usage){
+  char done = 1;
+  template_exit info;
+  if(send(sock, &done, 1, SEND_FLAGS) < 1 || read(sock, &info, sizeof(info)) < sizeof(info))
+    return -1;
+  *status = info.status;
+  *usage = info.usage;
+  return 0;
+}
+
+SEXP R_template_close(SEXP ptr){
+  get_template(ptr);
+  fin_template(ptr);
+  return R_NilValue;
+}
+
+SEXP R_template_info(SEXP ptr){
+  return Rf_ScalarInteger(get_template(ptr)->pid);
+}
@@ -3,49 +3,114 @@
 
 #include <Rinternals.h>
 #include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <pwd.h>
 #include <grp.h>
 
-#define make_string(x) x ? Rf_mkString(x) : Rf_ScalarString(NA_STRING)
+#define make_string(x) x ? Rf_mkChar(x) : NA_STRING
 
 extern void bail_if(int err, const char * what);
 
+/* Buffer for the reentrant lookups, which grows when an entry does not fit
+ * (e.g. a group with many members). Freed on error by R_alloc. */
+typedef struct {
+  char * buf;
+  size_t size;
+} lookup_buffer;
+
+static void buffer_init(lookup_buffer * b, int name){
+  long size = sysconf(name);
+  b->size = size > 0 ? size : 16384;
+  b->buf = R_alloc(b->size, 1);
+}
+
+static int buffer_grow(lookup_buffer * b, int err){
+  if(err != ERANGE || b->size > (1 << 26))
+    return 0;
+  b->size *= 4;
+  b->buf = R_alloc(b->size, 1);
+  return 1;
+}
+
+/* Looks up all users in one call. Users that do not exist get NA values,
+ * except for the column that was used for the lookup. */
 SEXP R_user_info(SEXP input){
-  errno = 0;
-  struct passwd * info = Rf_isInteger(input) ? 
-    getpwuid(Rf_asInteger(input)) : 
-    getpwnam(CHAR(STRING_ELT(input, 0)));
-  bail_if(info == NULL, "getpwuid() / getpwnam()");
+  int n = Rf_length(input);
+  int by_id = Rf_isInteger(input);
   SEXP out = PROTECT(Rf_allocVector(VECSXP, 7));
-  SET_VECTOR_ELT(out, 0, make_string(info->pw_name));
-  SET_VECTOR_ELT(out, 1, make_string(info->pw_passwd));
-  SET_VECTOR_ELT(out, 2, Rf_ScalarInteger(info->pw_uid));
-  SET_VECTOR_ELT(out, 3, Rf_ScalarInteger(info->pw_gid));
-  SET_VECTOR_ELT(out, 4, make_string(info->pw_gecos));
-  SET_VECTOR_ELT(out, 5, make_string(info->pw_dir));
-  SET_VECTOR_ELT(out, 6, make_string(info->pw_shell));
+  SET_VECTOR_ELT(out, 0, Rf_allocVector(STRSXP, n));
+  SET_VECTOR_ELT(out, 1, Rf_allocVector(STRSXP, n));
+  SET_VECTOR_ELT(out, 2, Rf_allocVector(INTSXP, n));
+  SET_VECTOR_ELT(out, 3, Rf_allocVector(INTSXP, n));
+  SET_VECTOR_ELT(out, 4, Rf_allocVector(STRSXP, n));
+  SET_VECTOR_ELT(out, 5, Rf_allocVector(STRSXP, n));
+  SET_VECTOR_ELT(out, 6, Rf_allocVector(STRSXP, n));
+  lookup_buffer b;
+  buffer_init(&b, _SC_GETPW_R_SIZE_MAX);
+  for(int i = 0; i < n; i++){
+    struct passwd pwd;
+    struct passwd * info = NULL;
+    int err;
+    int missing = by_id ? INTEGER(input)[i] == NA_INTEGER : STRING_ELT(input, i) == NA_STRING;
+    do {
+      err = missing ? 0 : by_id ?
+        getpwuid_r(INTEGER(input)[i], &pwd, b.buf, b.size, &info) :
+        getpwnam_r(CHAR(STRING_ELT(input, i)), &pwd, b.buf, b.size, &info);
+    } while(err && buffer_grow(&b, err));
+    if(err && err != ENOENT){
+      errno = err;
+      bail_if(1, "getpwuid_r() / getpwnam_r()");
+    }
+    SET_STRING_ELT(VECTOR_ELT(out, 0), i, info ? make_string(info->pw_name) : by_id ? NA_STRING : STRING_ELT(input, i));
+    SET_STRING_ELT(VECTOR_ELT(out, 1), i, info ? make_string(info->pw_passwd) : NA_STRING);
+    INTEGER(VECTOR_ELT(out, 2))[i] = info ? (int) info->pw_uid : by_id ? INTEGER(input)[i] : NA_INTEGER;
+    INTEGER(VECTOR_ELT(out, 3))[i] = info ? (int) info->pw_gid : NA_INTEGER;
+    SET_STRING_ELT(VECTOR_ELT(out, 4), i, info ? make_string(info->pw_gecos) : NA_STRING);
+    SET_STRING_ELT(VECTOR_ELT(out, 5), i, info ? make_string(info->pw_dir) : NA_STRING);
+    SET_STRING_ELT(VECTOR_ELT(out, 6), i, info ? make_string(info->pw_shell) : NA_STRING);
+  }
   UNPROTECT(1);
   return out;
 }
 
 SEXP R_group_info(SEXP input){
-  errno = 0;
-  struct group * info = Rf_isInteger(input) ? 
-    getgrgid(Rf_asInteger(input)) : 
-    getgrnam(CHAR(STRING_ELT(input, 0)));
-  bail_if(info == NULL, "getgrgid() / getgrnam()");
+  int n = Rf_length(input);
+  int by_id = Rf_isInteger(input);
   SEXP out = PROTECT(Rf_allocVector(VECSXP, 4));
-  SET_VECTOR_ELT(out, 0, make_string(info->gr_name));
-  SET_VECTOR_ELT(out, 1, make_string(info->gr_passwd));
-  SET_VECTOR_ELT(out, 2, Rf_ScalarInteger(info->gr_gid));
-  int count = 0;
-  while(info->gr_mem[count])
-    count++;
-  SET_VECTOR_ELT(out, 3, Rf_allocVector(STRSXP, count));
-  for(int i = 0; i < count; i++)
-    SET_STRING_ELT(VECTOR_ELT(out, 3), i, Rf_mkChar(info->gr_mem[i]));
+  SET_VECTOR_ELT(out, 0, Rf_allocVector(STRSXP, n));
+  SET_VECTOR_ELT(out, 1, Rf_allocVector(STRSXP, n));
+  SET_VECTOR_ELT(out, 2, Rf_allocVector(INTSXP, n));
+  SET_VECTOR_ELT(out, 3, Rf_allocVector(VECSXP, n));
+  lookup_buffer b;
+  buffer_init(&b, _SC_GETGR_R_SIZE_MAX);
+  for(int i = 0; i < n; i++){
+    struct group grp;
+    struct group * info = NULL;
+    int err;
+    int missing = by_id ? INTEGER(input)[i] == NA_INTEGER : STRING_ELT(input, i) == NA_STRING;
+    do {
+      err = missing ? 0 : by_id ?
+        getgrgid_r(INTEGER(input)[i], &grp, b.buf, b.size, &info) :
+        getgrnam_r(CHAR(STRING_ELT(input, i)), &grp, b.buf, b.size, &info);
+    } while(err && buffer_grow(&b, err));
+    if(err && err != ENOENT){
+      errno = err;
+      bail_if(1, "getgrgid_r() / getgrnam_r()");
+    }
+    SET_STRING_ELT(VECTOR_ELT(out, 0), i, info ? make_string(info->gr_name) : by_id ? NA_STRING : STRING_ELT(input, i));
+    SET_STRING_ELT(VECTOR_ELT(out, 1), i, info ? make_string(info->gr_passwd) : NA_STRING);
+    INTEGER(VECTOR_ELT(out, 2))[i] = info ? (int) info->gr_gid : by_id ? INTEGER(input)[i] : NA_INTEGER;
+    int count = 0;
+    while(info && info->gr_mem[count])
+      count++;
+    SEXP members = Rf_allocVector(STRSXP, count);
+    SET_VECTOR_ELT(VECTOR_ELT(out, 3), i, members);
+    for(int j = 0; j < count; j++)
+      SET_STRING_ELT(members, j, Rf_mkChar(info->gr_mem[j]));
+  }
   UNPROTECT(1);
   return out;
 }
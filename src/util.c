@@ -18,32 +18,9 @@ extern void bail_if(int err, const char * what);
 #include <unistd.h>
 #include <sys/resource.h>
 
-// Missing on Solaris
-#ifndef RLIMIT_NPROC
-#define RLIMIT_NPROC -1
-#endif
-
-#ifndef RLIMIT_MEMLOCK
-#define RLIMIT_MEMLOCK -1
-#endif
-
-// Missing on OpenBSD
-#ifndef RLIMIT_AS
-#define RLIMIT_AS RLIMIT_DATA
-#endif
-
-// Order should match the R function
-static int rlimit_types[9] = {
-  RLIMIT_AS, //0
-  RLIMIT_CORE, //1
-  RLIMIT_CPU, //2
-  RLIMIT_DATA, //3
-  RLIMIT_FSIZE, //4
-  RLIMIT_MEMLOCK, //5
-  RLIMIT_NOFILE, //6
-  RLIMIT_NPROC, //7
-  RLIMIT_STACK, //8
-};
+//Defined in rlimit.c
+extern int rlimit_count(void);
+extern int apply_rlimits(const double * values);
 
 SEXP R_safe_build(void){
 #ifdef SYS_BUILD_SAFE
@@ -85,19 +62,9 @@ SEXP R_set_interactive(SEXP set){
 SEXP R_set_rlimits(SEXP limitvec){
   if(!Rf_isNumeric(limitvec))
     Rf_error("limitvec is not numeric");
-  size_t len = sizeof(rlimit_types)/sizeof(rlimit_types[0]);
-  if(Rf_length(limitvec) != len)
+  if(Rf_length(limitvec) != rlimit_count())
     Rf_error("limitvec wrong size");
-  for(int i = 0; i < len; i++){
-    int resource = rlimit_types[i];
-    double val = REAL(limitvec)[i];
-    if(resource < 0 || val == 0 || ISNA(val))
-      continue;
-    rlim_t rlim_val = R_finite(val) ? val : RLIM_INFINITY;
-    //Rprintf("Setting %d to %d\n", resource,  rlim_val);
-    struct rlimit lim = {rlim_val, rlim_val};
-    bail_if(setrlimit(resource, &lim) < 0, "setrlimit()");
-  }
+  bail_if(apply_rlimits(REAL(limitvec)) < 0, "setrlimit()");
   return R_NilValue;
 }
 